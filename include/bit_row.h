@@ -0,0 +1,19 @@
+#pragma once
+#include <switch/types.h>
+
+// Helpers for rows of bits packed 64 to a word, bit x % 64 of word x / 64
+
+// In a row of width bits, the first x >= from whose bit differs from bit from, or width
+int bitRowNextEdge(const u64* row, int words_per_row, int width, int from) {
+    u64 flip = (row[from / 64] >> (from % 64)) & 1 ? ~0ULL : 0;
+    int word = from / 64;
+    u64 bits = (row[word] ^ flip) >> (from % 64) << (from % 64);
+    while(bits == 0) {
+        if(++word >= words_per_row) {
+            return width;
+        }
+        bits = row[word] ^ flip;
+    }
+    int x = word * 64 + __builtin_ctzll(bits);
+    return x < width ? x : width;
+}
@@ -0,0 +1,420 @@
+#pragma once
+/*
+ * 3DS style AES-CCM (see ccm_3ds.h) specialised for the Mii QR shape:
+ * 12 byte nonce, no additional data, 16 byte tag and a message length known at compile time.
+ * Uses the ARMv8 AES instructions, or AES-NI on x86 hosts.
+ * Output is identical to mbedtls_ccm_star_encrypt_and_tag_3ds / mbedtls_ccm_auth_decrypt_3ds.
+ */
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <mbedtls/ccm.h>
+#include <mbedtls/platform_util.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define CCM3DS_HW_AES_ARM
+#define CCM3DS_HW_TARGET
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#define CCM3DS_HW_AES_X86
+#define CCM3DS_HW_TARGET __attribute__((target("aes,sse4.1")))
+#endif
+
+#if defined(CCM3DS_HW_AES_ARM) || defined(CCM3DS_HW_AES_X86)
+#define CCM3DS_HAVE_HW_AES
+#endif
+
+const int CCM3DS_NONCE_LEN = 12;
+const int CCM3DS_TAG_LEN = 16;
+// payloads processed together by the multi-buffer kernels
+const int CCM3DS_LANES = 8;
+
+typedef struct {
+    alignas(16) uint8_t round_keys[11][16];
+} aes128RoundKeys;
+
+bool ccm3dsHwAvailable() {
+#if defined(CCM3DS_HW_AES_ARM)
+#if defined(__linux__)
+    return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+    return true;
+#endif
+#elif defined(CCM3DS_HW_AES_X86)
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+#else
+    return false;
+#endif
+}
+
+#if defined(CCM3DS_HAVE_HW_AES)
+
+#if defined(CCM3DS_HW_AES_ARM)
+typedef uint8x16_t aesBlock;
+
+static inline aesBlock aesLoad(const uint8_t* p) {
+    return vld1q_u8(p);
+}
+static inline void aesStore(uint8_t* p, aesBlock b) {
+    vst1q_u8(p, b);
+}
+static inline aesBlock aesXor(aesBlock a, aesBlock b) {
+    return veorq_u8(a, b);
+}
+
+// w is in all four columns, so ShiftRows does nothing and AESE with a zero key is just SubBytes
+static inline uint32_t aesSubWord(uint32_t w) {
+    uint8x16_t b = vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0));
+    return vgetq_lane_u32(vreinterpretq_u32_u8(b), 0);
+}
+
+// Encrypts N independent blocks round by round, so their AES latencies overlap.
+template <int N>
+static inline void aesEncryptBlocks(const aes128RoundKeys* keys, aesBlock (&blocks)[N]) {
+    #pragma GCC unroll 9
+    for (int r = 0; r < 9; r++) {
+        const aesBlock rk = vld1q_u8(keys->round_keys[r]);
+        #pragma GCC unroll 16
+        for (int i = 0; i < N; i++) {
+            blocks[i] = vaesmcq_u8(vaeseq_u8(blocks[i], rk));
+        }
+    }
+    const aesBlock rk9 = vld1q_u8(keys->round_keys[9]);
+    const aesBlock rk10 = vld1q_u8(keys->round_keys[10]);
+    #pragma GCC unroll 16
+    for (int i = 0; i < N; i++) {
+        blocks[i] = veorq_u8(vaeseq_u8(blocks[i], rk9), rk10);
+    }
+}
+
+#else
+typedef __m128i aesBlock;
+
+CCM3DS_HW_TARGET static inline aesBlock aesLoad(const uint8_t* p) {
+    return _mm_loadu_si128((const __m128i*)p);
+}
+CCM3DS_HW_TARGET static inline void aesStore(uint8_t* p, aesBlock b) {
+    _mm_storeu_si128((__m128i*)p, b);
+}
+CCM3DS_HW_TARGET static inline aesBlock aesXor(aesBlock a, aesBlock b) {
+    return _mm_xor_si128(a, b);
+}
+
+// w is in all four columns, so ShiftRows does nothing and AESENCLAST with a zero key is just SubBytes
+CCM3DS_HW_TARGET static inline uint32_t aesSubWord(uint32_t w) {
+    return _mm_cvtsi128_si32(_mm_aesenclast_si128(_mm_set1_epi32(w), _mm_setzero_si128()));
+}
+
+// Encrypts N independent blocks round by round, so their AES latencies overlap.
+template <int N>
+CCM3DS_HW_TARGET static inline void aesEncryptBlocks(const aes128RoundKeys* keys, aesBlock (&blocks)[N]) {
+    const aesBlock rk0 = aesLoad(keys->round_keys[0]);
+    #pragma GCC unroll 16
+    for (int i = 0; i < N; i++) {
+        blocks[i] = _mm_xor_si128(blocks[i], rk0);
+    }
+    #pragma GCC unroll 9
+    for (int r = 1; r < 10; r++) {
+        const aesBlock rk = aesLoad(keys->round_keys[r]);
+        #pragma GCC unroll 16
+        for (int i = 0; i < N; i++) {
+            blocks[i] = _mm_aesenc_si128(blocks[i], rk);
+        }
+    }
+    const aesBlock rk10 = aesLoad(keys->round_keys[10]);
+    #pragma GCC unroll 16
+    for (int i = 0; i < N; i++) {
+        blocks[i] = _mm_aesenclast_si128(blocks[i], rk10);
+    }
+}
+#endif
+
+CCM3DS_HW_TARGET void aes128ExpandKey(const uint8_t key[16], aes128RoundKeys* out) {
+    uint32_t w[44];
+    uint32_t rcon = 1;
+    memcpy(w, key, 16);
+    for (int i = 4; i < 44; i++) {
+        uint32_t t = w[i-1];
+        if (i % 4 == 0) {
+            // RotWord on a little-endian word is a rotate right by 8
+            t = aesSubWord((t >> 8) | (t << 24)) ^ rcon;
+            rcon = ((rcon << 1) ^ ((rcon & 0x80) ? 0x1B : 0)) & 0xFF;
+        }
+        w[i] = w[i-4] ^ t;
+    }
+    memcpy(out->round_keys, w, sizeof(w));
+}
+
+/*
+ * Layout of one message with LENGTH bytes.
+ * The 3DS puts the length padded to a whole block in B_0, which is why it is computed from BLOCKS.
+ */
+template <size_t LENGTH>
+struct ccm3dsShape {
+    static constexpr size_t BLOCKS = (LENGTH + 15) / 16;
+    static constexpr size_t PADDED_LEN = BLOCKS * 16;
+    static_assert(BLOCKS > 0 && BLOCKS < 0x100, "counter is kept in the last byte");
+};
+
+// B_0 for a 12 byte nonce, no additional data and a 16 byte tag. q = 3, so flags are (7 << 3) | 2
+template <size_t LENGTH>
+void ccm3dsFirstBlock(const uint8_t nonce[CCM3DS_NONCE_LEN], uint8_t out[16]) {
+    out[0] = (((CCM3DS_TAG_LEN - 2) / 2) << 3) | (16 - 1 - CCM3DS_NONCE_LEN - 1);
+    memcpy(out + 1, nonce, CCM3DS_NONCE_LEN);
+    out[13] = (ccm3dsShape<LENGTH>::PADDED_LEN >> 16) & 0xFF;
+    out[14] = (ccm3dsShape<LENGTH>::PADDED_LEN >> 8) & 0xFF;
+    out[15] = ccm3dsShape<LENGTH>::PADDED_LEN & 0xFF;
+}
+
+// counter block with flags q - 1 and the counter in the last byte
+void ccm3dsCounterBlock(const uint8_t nonce[CCM3DS_NONCE_LEN], uint8_t out[16]) {
+    out[0] = 16 - 1 - CCM3DS_NONCE_LEN - 1;
+    memcpy(out + 1, nonce, CCM3DS_NONCE_LEN);
+    out[13] = 0;
+    out[14] = 0;
+    out[15] = 0;
+}
+
+/*
+ * The CBC-MAC step for each block is paired with the CTR keystream block for the same position,
+ * so two independent AES operations are always in flight.
+ */
+template <size_t LENGTH>
+CCM3DS_HW_TARGET void ccm3dsHwEncrypt(const aes128RoundKeys* keys, const uint8_t nonce[CCM3DS_NONCE_LEN],
+                                      const uint8_t* input, uint8_t* output, uint8_t tag[CCM3DS_TAG_LEN]) {
+    typedef ccm3dsShape<LENGTH> shape;
+    alignas(16) uint8_t data[shape::PADDED_LEN] = {0};
+    alignas(16) uint8_t b0[16];
+    alignas(16) uint8_t ctr[16];
+    memcpy(data, input, LENGTH);
+    ccm3dsFirstBlock<LENGTH>(nonce, b0);
+    ccm3dsCounterBlock(nonce, ctr);
+
+    aesBlock pair[2] = {aesLoad(b0), aesLoad(ctr)};
+    aesEncryptBlocks(keys, pair);
+    aesBlock mac = pair[0];
+    const aesBlock tag_mask = pair[1];
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < shape::BLOCKS; i++) {
+        const aesBlock plain = aesLoad(data + i*16);
+        ctr[15] = i + 1;
+        pair[0] = aesXor(mac, plain);
+        pair[1] = aesLoad(ctr);
+        aesEncryptBlocks(keys, pair);
+        mac = pair[0];
+        aesStore(data + i*16, aesXor(plain, pair[1]));
+    }
+    memcpy(output, data, LENGTH);
+    aesStore(tag, aesXor(mac, tag_mask));
+}
+
+/*
+ * All keystream blocks and E(B_0) are independent, so they are computed together up front.
+ * Only the CBC-MAC chain is left serial.
+ */
+template <size_t LENGTH>
+CCM3DS_HW_TARGET int ccm3dsHwDecrypt(const aes128RoundKeys* keys, const uint8_t nonce[CCM3DS_NONCE_LEN],
+                                     const uint8_t* input, uint8_t* output, const uint8_t tag[CCM3DS_TAG_LEN]) {
+    typedef ccm3dsShape<LENGTH> shape;
+    alignas(16) uint8_t data[shape::PADDED_LEN] = {0};
+    alignas(16) uint8_t b0[16];
+    alignas(16) uint8_t ctr[16];
+    alignas(16) uint8_t check_tag[16];
+    memcpy(data, input, LENGTH);
+    ccm3dsFirstBlock<LENGTH>(nonce, b0);
+    ccm3dsCounterBlock(nonce, ctr);
+
+    // [0] is B_0, [1 + i] is counter i
+    aesBlock blocks[shape::BLOCKS + 2];
+    blocks[0] = aesLoad(b0);
+    #pragma GCC unroll 16
+    for (size_t i = 0; i <= shape::BLOCKS; i++) {
+        ctr[15] = i;
+        blocks[1 + i] = aesLoad(ctr);
+    }
+    aesEncryptBlocks(keys, blocks);
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < shape::BLOCKS; i++) {
+        aesStore(data + i*16, aesXor(aesLoad(data + i*16), blocks[2 + i]));
+    }
+    // the MAC is over the plaintext padded with zeros
+    memset(data + LENGTH, 0, shape::PADDED_LEN - LENGTH);
+
+    aesBlock mac[1] = {blocks[0]};
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < shape::BLOCKS; i++) {
+        mac[0] = aesXor(mac[0], aesLoad(data + i*16));
+        aesEncryptBlocks(keys, mac);
+    }
+    aesStore(check_tag, aesXor(mac[0], blocks[1]));
+
+    // Check tag in "constant-time"
+    int diff = 0;
+    for (int i = 0; i < CCM3DS_TAG_LEN; i++) {
+        diff |= tag[i] ^ check_tag[i];
+    }
+    if (diff != 0) {
+        mbedtls_platform_zeroize(output, LENGTH);
+        mbedtls_platform_zeroize(data, sizeof(data));
+        return MBEDTLS_ERR_CCM_AUTH_FAILED;
+    }
+    memcpy(output, data, LENGTH);
+    mbedtls_platform_zeroize(data, sizeof(data));
+    return 0;
+}
+
+/*
+ * Multi-buffer versions for LANES independent messages.
+ * CBC-MAC is serial within one message, so each step advances every lane by one block
+ * and the AES rounds of different lanes overlap instead of waiting on each other.
+ */
+template <size_t LENGTH, int LANES>
+CCM3DS_HW_TARGET void ccm3dsHwEncryptLanes(const aes128RoundKeys* keys, const uint8_t* const nonces[LANES],
+                                           const uint8_t* const inputs[LANES], uint8_t* const outputs[LANES],
+                                           uint8_t* const tags[LANES]) {
+    typedef ccm3dsShape<LENGTH> shape;
+    alignas(16) uint8_t data[LANES][shape::PADDED_LEN];
+    alignas(16) uint8_t ctr[LANES][16];
+    alignas(16) uint8_t b0[16];
+    // [2 * l] is the MAC of lane l and [2 * l + 1] its keystream block
+    aesBlock blocks[2 * LANES];
+    aesBlock mac[LANES];
+    aesBlock tag_mask[LANES];
+
+    #pragma GCC unroll 16
+    for (int l = 0; l < LANES; l++) {
+        memcpy(data[l], inputs[l], LENGTH);
+        memset(data[l] + LENGTH, 0, shape::PADDED_LEN - LENGTH);
+        ccm3dsFirstBlock<LENGTH>(nonces[l], b0);
+        ccm3dsCounterBlock(nonces[l], ctr[l]);
+        blocks[2 * l] = aesLoad(b0);
+        blocks[2 * l + 1] = aesLoad(ctr[l]);
+    }
+    aesEncryptBlocks(keys, blocks);
+    #pragma GCC unroll 16
+    for (int l = 0; l < LANES; l++) {
+        mac[l] = blocks[2 * l];
+        tag_mask[l] = blocks[2 * l + 1];
+    }
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < shape::BLOCKS; i++) {
+        #pragma GCC unroll 16
+        for (int l = 0; l < LANES; l++) {
+            ctr[l][15] = i + 1;
+            blocks[2 * l] = aesXor(mac[l], aesLoad(data[l] + i*16));
+            blocks[2 * l + 1] = aesLoad(ctr[l]);
+        }
+        aesEncryptBlocks(keys, blocks);
+        #pragma GCC unroll 16
+        for (int l = 0; l < LANES; l++) {
+            mac[l] = blocks[2 * l];
+            aesStore(data[l] + i*16, aesXor(aesLoad(data[l] + i*16), blocks[2 * l + 1]));
+        }
+    }
+
+    #pragma GCC unroll 16
+    for (int l = 0; l < LANES; l++) {
+        memcpy(outputs[l], data[l], LENGTH);
+        aesStore(tags[l], aesXor(mac[l], tag_mask[l]));
+    }
+}
+
+/*
+ * results[l] is 0 or MBEDTLS_ERR_CCM_AUTH_FAILED for each lane.
+ * The keystream block for i + 1 is computed alongside the MAC step for block i.
+ */
+template <size_t LENGTH, int LANES>
+CCM3DS_HW_TARGET void ccm3dsHwDecryptLanes(const aes128RoundKeys* keys, const uint8_t* const nonces[LANES],
+                                           const uint8_t* const inputs[LANES], uint8_t* const outputs[LANES],
+                                           const uint8_t* const tags[LANES], int results[LANES]) {
+    typedef ccm3dsShape<LENGTH> shape;
+    alignas(16) uint8_t data[LANES][shape::PADDED_LEN];
+    alignas(16) uint8_t ctr[LANES][16];
+    alignas(16) uint8_t b0[16];
+    alignas(16) uint8_t check_tag[16];
+    // B_0, counter 0 and counter 1 of every lane
+    aesBlock first[3 * LANES];
+    // [2 * l] is the MAC of lane l and [2 * l + 1] its next keystream block
+    aesBlock blocks[2 * LANES];
+    aesBlock mac[LANES];
+    aesBlock keystream[LANES];
+    aesBlock tag_mask[LANES];
+
+    #pragma GCC unroll 16
+    for (int l = 0; l < LANES; l++) {
+        memcpy(data[l], inputs[l], LENGTH);
+        memset(data[l] + LENGTH, 0, shape::PADDED_LEN - LENGTH);
+        ccm3dsFirstBlock<LENGTH>(nonces[l], b0);
+        ccm3dsCounterBlock(nonces[l], ctr[l]);
+        first[3 * l] = aesLoad(b0);
+        first[3 * l + 1] = aesLoad(ctr[l]);
+        ctr[l][15] = 1;
+        first[3 * l + 2] = aesLoad(ctr[l]);
+    }
+    aesEncryptBlocks(keys, first);
+    #pragma GCC unroll 16
+    for (int l = 0; l < LANES; l++) {
+        mac[l] = first[3 * l];
+        tag_mask[l] = first[3 * l + 1];
+        keystream[l] = first[3 * l + 2];
+    }
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < shape::BLOCKS; i++) {
+        #pragma GCC unroll 16
+        for (int l = 0; l < LANES; l++) {
+            aesStore(data[l] + i*16, aesXor(aesLoad(data[l] + i*16), keystream[l]));
+        }
+        if (i == shape::BLOCKS - 1) {
+            // the MAC is over the plaintext padded with zeros
+            #pragma GCC unroll 16
+            for (int l = 0; l < LANES; l++) {
+                memset(data[l] + LENGTH, 0, shape::PADDED_LEN - LENGTH);
+                mac[l] = aesXor(mac[l], aesLoad(data[l] + i*16));
+            }
+            aesEncryptBlocks(keys, mac);
+        }
+        else {
+            #pragma GCC unroll 16
+            for (int l = 0; l < LANES; l++) {
+                ctr[l][15] = i + 2;
+                blocks[2 * l] = aesXor(mac[l], aesLoad(data[l] + i*16));
+                blocks[2 * l + 1] = aesLoad(ctr[l]);
+            }
+            aesEncryptBlocks(keys, blocks);
+            #pragma GCC unroll 16
+            for (int l = 0; l < LANES; l++) {
+                mac[l] = blocks[2 * l];
+                keystream[l] = blocks[2 * l + 1];
+            }
+        }
+    }
+
+    for (int l = 0; l < LANES; l++) {
+        aesStore(check_tag, aesXor(mac[l], tag_mask[l]));
+        // Check tag in "constant-time"
+        int diff = 0;
+        for (int i = 0; i < CCM3DS_TAG_LEN; i++) {
+            diff |= tags[l][i] ^ check_tag[i];
+        }
+        if (diff != 0) {
+            mbedtls_platform_zeroize(outputs[l], LENGTH);
+            results[l] = MBEDTLS_ERR_CCM_AUTH_FAILED;
+        }
+        else {
+            memcpy(outputs[l], data[l], LENGTH);
+            results[l] = 0;
+        }
+    }
+    mbedtls_platform_zeroize(data, sizeof(data));
+}
+
+#endif
@@ -1,7 +1,10 @@
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
+#include <cstddef>
 
 #include "switch/types.h"
+#include "switch/crypto/hmac.h"
 #include "mii_ext.h"
 #include "crc.hpp"
 
@@ -39,22 +42,102 @@ void setCrc16(void* in, int size) {
     *(u16*)((u8*)in + size - sizeof(u16)) = crc16LE(in, size - sizeof(u16));
 }
 
+/*
+ * This console's Mii author ID. Getting it is an IPC call, so it is fetched once and reused.
+ * A failed fetch is retried on the next call. setsys must already be initialized.
+ */
+Result getMiiAuthorId(Uuid* out) {
+    static Uuid author_id;
+    static bool fetched = false;
+    if(!fetched) {
+        Result res = setsysGetMiiAuthorId(&author_id);
+        if(R_FAILED(res)) {
+            printf("setsysGetMiiAuthorId failed: 0x%x\n", res);
+            return res;
+        }
+        fetched = true;
+    }
+    *out = author_id;
+    return 0;
+}
+
+// The device crc of a storeData is seeded with the crc of this console's Mii author ID.
+class StoreDataCrcContext {
+    private:
+        int device_id_crc = 0;
+
+    public:
+        Result init() {
+            Uuid device_id;
+            Result res = getMiiAuthorId(&device_id);
+            if(R_FAILED(res)) return res;
+            device_id_crc = crc16(&device_id, sizeof(device_id));
+            return 0;
+        }
+
+        void setDeviceCrc16(void* in, int size) const {
+            *(u16*)((u8*)in + size - sizeof(u16)) = crc16LE(in, size - sizeof(u16), device_id_crc);
+        }
+
+        void setStoreDataCrc16(storeData* in) const {
+            setCrc16(in, sizeof(storeData) - sizeof(u16));
+            setDeviceCrc16(in, sizeof(storeData));
+        }
+
+        void setStoreDataCrc16(storeData* in, size_t count) const {
+            for(size_t i = 0; i < count; i++) {
+                setStoreDataCrc16(&in[i]);
+            }
+        }
+};
+
+// shared context, initialized on first use. setsys must already be initialized.
+const StoreDataCrcContext& getStoreDataCrcContext() {
+    static StoreDataCrcContext ctx;
+    static bool initialized = false;
+    if(!initialized) {
+        initialized = R_SUCCEEDED(ctx.init());
+    }
+    return ctx;
+}
+
 void setDeviceCrc16(void* in, int size) {
-    Uuid device_id;
-    setsysGetMiiAuthorId(&device_id);
-    int device_id_crc = crc16(&device_id, sizeof(device_id));
-    *(u16*)((u8*)in + size - sizeof(u16)) =  crc16LE(in, size - sizeof(u16), device_id_crc);
+    getStoreDataCrcContext().setDeviceCrc16(in, size);
 }
 
 void setStoreDataCrc16(storeData* in) {
-    setCrc16(in, sizeof(storeData) - sizeof(u16));
-    setDeviceCrc16(in, sizeof(storeData));
+    getStoreDataCrcContext().setStoreDataCrc16(in);
 }
 
-void coreDataToStoreData(const coreData* in, const MiiCreateId* id, storeData* out) {
+void setStoreDataCrc16(storeData* in, size_t count) {
+    getStoreDataCrcContext().setStoreDataCrc16(in, count);
+}
+
+/*
+ * Replaces the create ID of a storeData that already has valid crcs, patching both crcs instead of recomputing them.
+ * create_id is the end of the crc16 range, and create_id + crc16 is the end of the crc16_device range.
+ * The device seed cancels out in the difference, so no author ID is needed.
+ */
+void updateStoreDataCrcForCreateId(storeData* data, const MiiCreateId* new_id) {
+    static_assert(offsetof(storeData, crc16) == offsetof(storeData, create_id) + sizeof(MiiCreateId), "storeData layout");
+    static_assert(offsetof(storeData, crc16_device) == sizeof(storeData) - sizeof(u16), "storeData layout");
+    u8 old_tail[sizeof(MiiCreateId) + sizeof(u16)];
+    memcpy(old_tail, &data->create_id, sizeof(old_tail));
+
+    u16 crc = __builtin_bswap16(data->crc16);
+    crc = crc16Patch(crc, &data->create_id, new_id, sizeof(MiiCreateId), 0);
+    data->create_id = *new_id;
+    data->crc16 = __builtin_bswap16(crc);
+
+    u16 device_crc = __builtin_bswap16(data->crc16_device);
+    device_crc = crc16Patch(device_crc, old_tail, &data->create_id, sizeof(old_tail), 0);
+    data->crc16_device = __builtin_bswap16(device_crc);
+}
+
+void coreDataToStoreData(const coreData* in, const MiiCreateId* id, storeData* out, const StoreDataCrcContext& ctx = getStoreDataCrcContext()) {
     out->core_data = *in;
     out->create_id = *id;
-    setStoreDataCrc16(out);
+    ctx.setStoreDataCrc16(out);
 }
 
 void cleanVer3Name(char16_t* name, u32 length) {
@@ -69,7 +152,7 @@ void cleanVer3Name(char16_t* name, u32 length) {
     }
 }
 
-void ver3StoreDataToStoreData(const ver3StoreData* in, storeData* out) {
+void ver3StoreDataToStoreData(const ver3StoreData* in, storeData* out, const StoreDataCrcContext& ctx = getStoreDataCrcContext()) {
     out->core_data.font_region = in->font_region;
     out->core_data.favorite_color = in->favorite_color;
     out->core_data.gender = in->gender;
@@ -123,10 +206,32 @@ void ver3StoreDataToStoreData(const ver3StoreData* in, storeData* out) {
     memcpy(out->core_data.nickname, in->name, 10 * sizeof(char16_t));
     cleanVer3Name(out->core_data.nickname, 10);
     makeRandCreateId(&out->create_id);
-    coreDataToStoreData(&out->core_data, &out->create_id, out);
+    coreDataToStoreData(&out->core_data, &out->create_id, out, ctx);
+}
+
+/*
+ * Sets out's create_id and author_id from a Switch create_id with HMAC-SHA256, keyed with
+ * this console's Mii author ID. The same Mii always gets the same IDs on this console,
+ * but the Switch create_id can't be read back out of them.
+ * Returns false if the author ID can't be read, in which case nothing is written.
+ */
+bool deriveVer3Ids(const MiiCreateId* in, ver3StoreData* out) {
+    Uuid key;
+    if(R_FAILED(getMiiAuthorId(&key))) {
+        return false;
+    }
+    u8 mac[SHA256_HASH_SIZE];
+    hmacSha256CalculateMac(mac, &key, sizeof(key), in, sizeof(MiiCreateId));
+    memcpy(out->create_id, mac, sizeof(out->create_id));
+    memcpy(&out->author_id, mac + SHA256_HASH_SIZE - sizeof(out->author_id), sizeof(out->author_id));
+    return true;
 }
 
-void charInfoToVer3StoreData(const charInfo* in, ver3StoreData* out) {
+/*
+ * create_id and author_id are random unless deterministic is set, then they're derived from in->create_id.
+ * Falls back to random IDs if the console's author ID can't be read.
+ */
+void charInfoToVer3StoreData(const charInfo* in, ver3StoreData* out, bool deterministic = false) {
     memset(out, 0, sizeof(ver3StoreData));
     out->font_region = in->font_region;
     out->favorite_color = in->favorite_color;
@@ -183,7 +288,10 @@ void charInfoToVer3StoreData(const charInfo* in, ver3StoreData* out) {
     out->birth_platform = 3;
     out->birth_month = 4;
     out->birth_day = 20;
-    randomGet(out->create_id, sizeof(out->create_id));
+    if(!deterministic || !deriveVer3Ids(&in->create_id, out)) {
+        randomGet(out->create_id, sizeof(out->create_id));
+        randomGet(&out->author_id, sizeof(out->author_id));
+    }
     /* 
      * Set 0b1101 in the 4 MSB of create_id
      * This sets non-special and some unknown flags
@@ -191,7 +299,6 @@ void charInfoToVer3StoreData(const charInfo* in, ver3StoreData* out) {
      * but all other QRs I checked had 0b1001
      */
     out->create_id[0] = (out->create_id[0] & 0b0000'1111) | 0b1101'0000;
-    randomGet(&out->author_id, sizeof(out->author_id));
     memcpy(out->creator_name, u"MiiPort", sizeof(u"MiiPort"));
     setCrc16(out, sizeof(ver3StoreData));
 }
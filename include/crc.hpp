@@ -1,20 +1,192 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 
-int crc16(void *ptr, size_t len, int crc) {
-    char *addr = (char*)ptr;
-    const int poly = 0x1021;
-    int i;
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define CRC16_HAVE_PMULL
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#define CRC16_HAVE_PCLMUL
+#endif
+
+const int CRC16_POLY = 0x1021;
+
+typedef std::array<std::array<uint16_t, 256>, 8> crc16TableSet;
+
+/*
+ * tables[0] is the usual byte-at-a-time table.
+ * tables[k] is the crc of a byte followed by k zero bytes,
+ * which lets crc16Slice8 consume 8 bytes per step.
+ */
+constexpr crc16TableSet makeCrc16Tables() {
+    crc16TableSet tables{};
+    for (int b = 0; b < 256; b++) {
+        uint16_t crc = b << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY : crc << 1;
+        }
+        tables[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint16_t prev = tables[k-1][b];
+            tables[k][b] = (uint16_t)(prev << 8) ^ tables[0][prev >> 8];
+        }
+    }
+    return tables;
+}
+
+constexpr crc16TableSet CRC16_TABLES = makeCrc16Tables();
+
+uint16_t crc16Table(const uint8_t *addr, size_t len, uint16_t crc) {
+    for (; len>0; len--) {
+        crc = (uint16_t)(crc << 8) ^ CRC16_TABLES[0][(crc >> 8) ^ *addr++];
+    }
+    return crc;
+}
+
+uint16_t crc16Slice8(const uint8_t *addr, size_t len, uint16_t crc) {
+    for (; len >= 8; len -= 8, addr += 8) {
+        crc = CRC16_TABLES[7][addr[0] ^ (crc >> 8)] ^
+              CRC16_TABLES[6][addr[1] ^ (crc & 0xFF)] ^
+              CRC16_TABLES[5][addr[2]] ^
+              CRC16_TABLES[4][addr[3]] ^
+              CRC16_TABLES[3][addr[4]] ^
+              CRC16_TABLES[2][addr[5]] ^
+              CRC16_TABLES[1][addr[6]] ^
+              CRC16_TABLES[0][addr[7]];
+    }
+    return crc16Table(addr, len, crc);
+}
+
+// crc of len more zero bytes following a message with the given crc
+uint16_t crc16ZeroExtend(uint16_t crc, size_t len) {
     for (; len>0; len--) {
-        crc = crc ^ (*addr++ << 8);
-        for (i=0; i<8; i++) {
-            if (crc & 0x8000) {
-                crc = (crc << 1) ^ poly;
-            }
-            else {
-                crc = crc << 1;
-            }
+        crc = (uint16_t)(crc << 8) ^ CRC16_TABLES[0][crc >> 8];
+    }
+    return crc;
+}
+
+/*
+ * Updates the crc of a message after len bytes were changed from old_bytes to new_bytes.
+ * bytes_after is how many bytes of the message follow the changed range.
+ * The crc is linear, so the change is the zero seeded crc of old^new, carried through the rest of the message.
+ */
+uint16_t crc16Patch(uint16_t crc, const void *old_bytes, const void *new_bytes, size_t len, size_t bytes_after) {
+    const uint8_t *old_addr = (const uint8_t*)old_bytes;
+    const uint8_t *new_addr = (const uint8_t*)new_bytes;
+    uint16_t delta = 0;
+    for (size_t i = 0; i < len; i++) {
+        delta = (uint16_t)(delta << 8) ^ CRC16_TABLES[0][(delta >> 8) ^ old_addr[i] ^ new_addr[i]];
+    }
+    return crc ^ crc16ZeroExtend(delta, bytes_after);
+}
+
+// x^n mod CRC16_POLY, used as folding constants
+constexpr uint64_t crc16XPowMod(int n) {
+    uint32_t rem = 1;
+    for (int i = 0; i < n; i++) {
+        rem <<= 1;
+        if (rem & 0x10000) {
+            rem ^= 0x10000 | CRC16_POLY;
         }
-    } 
-    return(crc);
+    }
+    return rem;
+}
+
+/*
+ * Carry-less multiply folding.
+ * The input is read as 128 bit big-endian blocks. The accumulator acc = hi:lo is kept congruent
+ * to the message so far, and each new block is folded in as
+ *   acc * x^128 + block = hi * (x^192 mod P) + lo * (x^128 mod P) + block
+ * Both products are under 80 bits, so acc never grows past 128 bits.
+ * The final 16 byte accumulator and any tail bytes are finished with the table engine.
+ * Only used for len >= CRC16_FOLD_MIN_LEN.
+ */
+const size_t CRC16_FOLD_MIN_LEN = 32;
+const uint64_t CRC16_FOLD_K128 = crc16XPowMod(128);
+const uint64_t CRC16_FOLD_K192 = crc16XPowMod(192);
+
+#if defined(CRC16_HAVE_PMULL)
+uint16_t crc16FoldPmull(const uint8_t *addr, size_t len, uint16_t crc) {
+    uint64_t hi, lo;
+    memcpy(&hi, addr, sizeof(uint64_t));
+    memcpy(&lo, addr + 8, sizeof(uint64_t));
+    hi = __builtin_bswap64(hi) ^ ((uint64_t)crc << 48);
+    lo = __builtin_bswap64(lo);
+    for (addr += 16, len -= 16; len >= 16; addr += 16, len -= 16) {
+        uint64_t next_hi, next_lo;
+        memcpy(&next_hi, addr, sizeof(uint64_t));
+        memcpy(&next_lo, addr + 8, sizeof(uint64_t));
+        uint64x2_t folded = veorq_u64(
+            vreinterpretq_u64_p128(vmull_p64((poly64_t)hi, (poly64_t)CRC16_FOLD_K192)),
+            vreinterpretq_u64_p128(vmull_p64((poly64_t)lo, (poly64_t)CRC16_FOLD_K128))
+        );
+        hi = vgetq_lane_u64(folded, 1) ^ __builtin_bswap64(next_hi);
+        lo = vgetq_lane_u64(folded, 0) ^ __builtin_bswap64(next_lo);
+    }
+    uint64_t acc[2] = {__builtin_bswap64(hi), __builtin_bswap64(lo)};
+    crc = crc16Slice8((const uint8_t*)acc, sizeof(acc), 0);
+    return crc16Slice8(addr, len, crc);
+}
+#endif
+
+#if defined(CRC16_HAVE_PCLMUL)
+__attribute__((target("pclmul,ssse3")))
+uint16_t crc16FoldPclmul(const uint8_t *addr, size_t len, uint16_t crc) {
+    // reverses byte order so that lane 1 holds the first 8 bytes as a big-endian number
+    const __m128i bswap_mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k = _mm_set_epi64x(CRC16_FOLD_K192, CRC16_FOLD_K128);
+    __m128i acc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)addr), bswap_mask);
+    acc = _mm_xor_si128(acc, _mm_set_epi64x((uint64_t)crc << 48, 0));
+    for (addr += 16, len -= 16; len >= 16; addr += 16, len -= 16) {
+        __m128i next = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)addr), bswap_mask);
+        acc = _mm_xor_si128(
+            _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11), _mm_clmulepi64_si128(acc, k, 0x00)),
+            next
+        );
+    }
+    uint8_t folded[16];
+    _mm_storeu_si128((__m128i*)folded, _mm_shuffle_epi8(acc, bswap_mask));
+    crc = crc16Slice8(folded, sizeof(folded), 0);
+    return crc16Slice8(addr, len, crc);
+}
+#endif
+
+typedef uint16_t (*crc16Kernel)(const uint8_t *addr, size_t len, uint16_t crc);
+
+// picks the fastest kernel this cpu supports, falling back to slice-by-8
+crc16Kernel selectCrc16Kernel() {
+#if defined(CRC16_HAVE_PMULL)
+#if defined(__linux__)
+    if (!(getauxval(AT_HWCAP) & HWCAP_PMULL)) {
+        return crc16Slice8;
+    }
+#endif
+    return crc16FoldPmull;
+#elif defined(CRC16_HAVE_PCLMUL)
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+        return crc16FoldPclmul;
+    }
+#endif
+    return crc16Slice8;
+}
+
+const crc16Kernel crc16FoldKernel = selectCrc16Kernel();
+
+// Only the low 16 bits of crc are meaningful, both as a seed and as a result.
+int crc16(void *ptr, size_t len, int crc) {
+    if (len >= CRC16_FOLD_MIN_LEN) {
+        return crc16FoldKernel((const uint8_t*)ptr, len, (uint16_t)crc);
+    }
+    return crc16Slice8((const uint8_t*)ptr, len, (uint16_t)crc);
 }
 
 int crc16(void *ptr, size_t len) {
@@ -27,4 +199,4 @@ int crc16LE(void *ptr, size_t len, int crc) {
 
 int crc16LE(void *ptr, size_t len) {
     return __builtin_bswap16(crc16(ptr, len, 0));
-}
\ No newline at end of file
+}
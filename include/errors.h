@@ -10,3 +10,4 @@
 #define SHOWING_POPUP     MAKERESULT(MIIPORT_MOUDLE,5)
 #define BAD_KEY_FILE      MAKERESULT(MIIPORT_MOUDLE,6)
 #define MISSING_KEY_FILE  MAKERESULT(MIIPORT_MOUDLE,7)
+#define FILE_READ_FAIL    MAKERESULT(MIIPORT_MOUDLE,8)
@@ -0,0 +1,118 @@
+#pragma once
+#include <switch/types.h>
+#include "errors.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include <sys/stat.h>
+
+#if !defined(__SWITCH__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define FILE_INPUT_HAVE_MMAP
+#endif
+
+/*
+ * Read-only view of a whole file.
+ * Where mmap is available the file is mapped. Otherwise it is read into a per-thread buffer
+ * that is reused between files, so only one FileInput per thread should be open at a time.
+ */
+class FileInput {
+    private:
+        const u8* data = nullptr;
+        size_t size = 0;
+        bool mapped = false;
+
+        static std::vector<u8>& readBuffer() {
+            static thread_local std::vector<u8> buffer;
+            return buffer;
+        }
+
+        Result readWhole(const char* path) {
+            FILE* file = fopen(path, "rb");
+            if(file == nullptr) {
+                printf("File open error: %d\n", errno);
+                return FILE_READ_FAIL;
+            }
+            struct stat st;
+            if(fstat(fileno(file), &st) != 0 || st.st_size <= 0) {
+                fclose(file);
+                return FILE_READ_FAIL;
+            }
+            std::vector<u8>& buffer = readBuffer();
+            if(buffer.size() < (size_t)st.st_size) {
+                buffer.resize(st.st_size);
+            }
+            size_t size_read = fread(buffer.data(), 1, st.st_size, file);
+            fclose(file);
+            if(size_read != (size_t)st.st_size) {
+                printf("File read error: %s\n", path);
+                return FILE_READ_FAIL;
+            }
+            data = buffer.data();
+            size = size_read;
+            return 0;
+        }
+
+#if defined(FILE_INPUT_HAVE_MMAP)
+        Result mapWhole(const char* path) {
+            int fd = ::open(path, O_RDONLY);
+            if(fd < 0) {
+                printf("File open error: %d\n", errno);
+                return FILE_READ_FAIL;
+            }
+            struct stat st;
+            if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+                ::close(fd);
+                return FILE_READ_FAIL;
+            }
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if(map == MAP_FAILED) {
+                return readWhole(path);
+            }
+            data = (const u8*)map;
+            size = st.st_size;
+            mapped = true;
+            return 0;
+        }
+#endif
+
+    public:
+        FileInput() = default;
+        FileInput(const FileInput&) = delete;
+        FileInput& operator=(const FileInput&) = delete;
+        ~FileInput() {
+            close();
+        }
+
+        Result open(const char* path) {
+            close();
+#if defined(FILE_INPUT_HAVE_MMAP)
+            return mapWhole(path);
+#else
+            return readWhole(path);
+#endif
+        }
+
+        void close() {
+#if defined(FILE_INPUT_HAVE_MMAP)
+            if(mapped) {
+                munmap((void*)data, size);
+            }
+#endif
+            data = nullptr;
+            size = 0;
+            mapped = false;
+        }
+
+        const u8* getData() const {
+            return data;
+        }
+
+        size_t getSize() const {
+            return size;
+        }
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <switch/types.h>
+
+#include <cstddef>
+#include <cstring>
+
+// Fast non-cryptographic 64 bit hash, 32 bytes per step
+u64 hash64(const void* data, size_t len, u64 seed = 0) {
+    const u64 P1 = 0x9E3779B185EBCA87ULL;
+    const u64 P2 = 0xC2B2AE3D27D4EB4FULL;
+    auto rotl = [](u64 x, int r) { return (x << r) | (x >> (64 - r)); };
+    const u8* p = (const u8*)data;
+    u64 h = seed + P1 + len;
+    if(len >= 32) {
+        u64 acc[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+        for(; len >= 32; len -= 32, p += 32) {
+            for(int i = 0; i < 4; i++) {
+                u64 v;
+                memcpy(&v, p + i * 8, sizeof(v));
+                acc[i] = rotl(acc[i] + v * P2, 31) * P1;
+            }
+        }
+        h += rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+    }
+    for(; len >= 8; len -= 8, p += 8) {
+        u64 v;
+        memcpy(&v, p, sizeof(v));
+        h = rotl(h ^ (rotl(v * P2, 31) * P1), 27) * P1 + P2;
+    }
+    for(; len > 0; len--, p++) {
+        h = rotl(h ^ (*p * P1), 11) * P2;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P1;
+    return h ^ (h >> 32);
+}
@@ -1,10 +1,15 @@
 #include "quirc.h"
 #include "turbojpeg.h"
 #include <ccm_3ds.h>
+#include <ccm_3ds_hw.h>
 #include <mbedtls/error.h>
 #include <switch/types.h>
 #include <switch/crypto/crc.h>
 #include "errors.h"
+#include "file_input.h"
+#include "qr_prefilter.h"
+#include "bit_row.h"
+#include "hash64.h"
 #include "mii_ext.h"
 #include "QR-Code-generator/QrCode.cpp"
 #include "scope_guard/scope_guard.hpp"
@@ -15,6 +20,15 @@
 #include <fstream>
 #include <cctype>
 #include <iomanip>
+#include <string>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <list>
+#include <unordered_map>
 #include <sys/stat.h>
 
 const char* QR_KEY_FILE_PATH = "/MiiPort/qrkey.txt";
@@ -81,252 +95,1417 @@ int getMiiKeyFromTxtFile(const char* path, miiQrKey* key_out) {
     return 0;
 }
 
-int aesCcmDecrypt(const void* in, void* out, const int size, const void* nonce, const int nonce_size, const void* key, const int key_size) {
-    int ret = 0;
-    mbedtls_ccm_context ctx;
-    mbedtls_ccm_init(&ctx);
-    const auto ccm_guard = sg::make_scope_guard([ctx{&ctx}]() { mbedtls_ccm_free(ctx); });
-    ret = mbedtls_ccm_setkey(&ctx,
-        MBEDTLS_CIPHER_ID_AES,
-        (unsigned char*)key,
-        key_size * 8
-    );
-    if(ret) {
-        char err[100] = {0};
-        mbedtls_strerror(ret, err, 99);
-        fprintf(stderr, "MbedTLS setkey: %s\n", err);
-        return ret;
-    }
-    ret = mbedtls_ccm_auth_decrypt_3ds(
-        &ctx,
-        size,
-        (unsigned char*)nonce,
-        nonce_size,
-        nullptr,
-        0,
-        (unsigned char*)in,
-        (unsigned char*)out,
-        (unsigned char*)in + size,
-        CCM_TAG_LEN
-    );
-    if(ret) {
-        char err[100] = {0};
-        mbedtls_strerror(ret, err, 99);
-        fprintf(stderr, "MbedTLS decrypt: %s\n", err);
+void printMbedtlsError(const char* what, int ret) {
+    char err[100] = {0};
+    mbedtls_strerror(ret, err, 99);
+    fprintf(stderr, "MbedTLS %s: %s\n", what, err);
+}
+
+const int QR_NONCE_SIZE = 8;
+const int QR_PADDED_NONCE_SIZE = 12;
+
+/*
+ * The QR nonce is 8 bytes from the middle of the ver3StoreData, padded to 12 with zeros.
+ * The rest of the ver3StoreData is what gets encrypted.
+ */
+void splitQrPlaintext(const ver3StoreData* in, u8* plain, u64* nonce) {
+    memcpy(plain, in, QR_PADDED_NONCE_SIZE);
+    memcpy(nonce, (u8*)in + QR_PADDED_NONCE_SIZE, QR_NONCE_SIZE);
+    memcpy(plain + QR_PADDED_NONCE_SIZE, (u8*)in + QR_PADDED_NONCE_SIZE + QR_NONCE_SIZE, QR_DATA_SIZE - QR_PADDED_NONCE_SIZE);
+}
+
+void joinQrPlaintext(const u8* plain, const u64* nonce, ver3StoreData* out) {
+    memcpy(out, plain, QR_PADDED_NONCE_SIZE);
+    memcpy((u8*)out + QR_PADDED_NONCE_SIZE, nonce, QR_NONCE_SIZE);
+    memcpy((u8*)out + QR_PADDED_NONCE_SIZE + QR_NONCE_SIZE, plain + QR_PADDED_NONCE_SIZE, QR_DATA_SIZE - QR_PADDED_NONCE_SIZE);
+}
+
+void padQrNonce(const u64* nonce, u8* padded) {
+    memcpy(padded, nonce, QR_NONCE_SIZE);
+    memset(padded + QR_NONCE_SIZE, 0, QR_PADDED_NONCE_SIZE - QR_NONCE_SIZE);
+}
+
+/*
+ * AES-CCM context for Mii QR data that stays keyed between uses,
+ * so the AES key schedule is only expanded once per key instead of once per QR.
+ */
+class MiiQrCipher {
+    private:
+        mbedtls_ccm_context ctx;
+        miiQrKey key;
+        bool keyed = false;
+#if defined(CCM3DS_HAVE_HW_AES)
+        aes128RoundKeys round_keys;
+        bool use_hw_aes = false;
+#endif
+
+        int ccmDecrypt(const u8* nonce, const u8* in, u8* out, const u8* tag) {
+#if defined(CCM3DS_HAVE_HW_AES)
+            if(use_hw_aes) {
+                return ccm3dsHwDecrypt<QR_DATA_SIZE>(&round_keys, nonce, in, out, tag);
+            }
+#endif
+            return mbedtls_ccm_auth_decrypt_3ds(&ctx, QR_DATA_SIZE, nonce, QR_PADDED_NONCE_SIZE, nullptr, 0, in, out, tag, CCM_TAG_LEN);
+        }
+
+        int ccmEncrypt(const u8* nonce, const u8* in, u8* out, u8* tag) {
+#if defined(CCM3DS_HAVE_HW_AES)
+            if(use_hw_aes) {
+                ccm3dsHwEncrypt<QR_DATA_SIZE>(&round_keys, nonce, in, out, tag);
+                return 0;
+            }
+#endif
+            return mbedtls_ccm_star_encrypt_and_tag_3ds(&ctx, QR_DATA_SIZE, nonce, QR_PADDED_NONCE_SIZE, nullptr, 0, in, out, tag, CCM_TAG_LEN);
+        }
+
+#if defined(CCM3DS_HAVE_HW_AES)
+        // CCM3DS_LANES payloads at once. CBC-MAC is serial within a payload, but not across payloads.
+        void decryptLanes(const miiQrData* in, ver3StoreData* out, Result* results) {
+            u8 nonces[CCM3DS_LANES][QR_PADDED_NONCE_SIZE];
+            u8 plain[CCM3DS_LANES][QR_DATA_SIZE];
+            const u8* nonce_ptrs[CCM3DS_LANES];
+            const u8* input_ptrs[CCM3DS_LANES];
+            u8* output_ptrs[CCM3DS_LANES];
+            const u8* tag_ptrs[CCM3DS_LANES];
+            int rets[CCM3DS_LANES];
+            for(int l = 0; l < CCM3DS_LANES; l++) {
+                padQrNonce(&in[l].nonce, nonces[l]);
+                nonce_ptrs[l] = nonces[l];
+                input_ptrs[l] = in[l].enc_data;
+                output_ptrs[l] = plain[l];
+                tag_ptrs[l] = in[l].ccm_mac;
+            }
+            ccm3dsHwDecryptLanes<QR_DATA_SIZE, CCM3DS_LANES>(&round_keys, nonce_ptrs, input_ptrs, output_ptrs, tag_ptrs, rets);
+            for(int l = 0; l < CCM3DS_LANES; l++) {
+                if(rets[l]) {
+                    printMbedtlsError("decrypt", rets[l]);
+                    results[l] = AES_CCM_FAILED;
+                }
+                else {
+                    joinQrPlaintext(plain[l], &in[l].nonce, &out[l]);
+                    results[l] = 0;
+                }
+            }
+        }
+
+        void encryptLanes(const ver3StoreData* in, miiQrData* out) {
+            u8 nonces[CCM3DS_LANES][QR_PADDED_NONCE_SIZE];
+            u8 plain[CCM3DS_LANES][QR_DATA_SIZE];
+            const u8* nonce_ptrs[CCM3DS_LANES];
+            const u8* input_ptrs[CCM3DS_LANES];
+            u8* output_ptrs[CCM3DS_LANES];
+            u8* tag_ptrs[CCM3DS_LANES];
+            for(int l = 0; l < CCM3DS_LANES; l++) {
+                splitQrPlaintext(&in[l], plain[l], &out[l].nonce);
+                padQrNonce(&out[l].nonce, nonces[l]);
+                nonce_ptrs[l] = nonces[l];
+                input_ptrs[l] = plain[l];
+                output_ptrs[l] = out[l].enc_data;
+                tag_ptrs[l] = out[l].ccm_mac;
+            }
+            ccm3dsHwEncryptLanes<QR_DATA_SIZE, CCM3DS_LANES>(&round_keys, nonce_ptrs, input_ptrs, output_ptrs, tag_ptrs);
+        }
+#endif
+
+    public:
+        MiiQrCipher() {
+            mbedtls_ccm_init(&ctx);
+        }
+        ~MiiQrCipher() {
+            mbedtls_ccm_free(&ctx);
+        }
+        MiiQrCipher(const MiiQrCipher&) = delete;
+        MiiQrCipher& operator=(const MiiQrCipher&) = delete;
+
+        bool isKeyed() const {
+            return keyed;
+        }
+
+        // Does nothing if already keyed with new_key
+        int setKey(const miiQrKey& new_key) {
+            if(keyed && memcmp(&key, &new_key, sizeof(miiQrKey)) == 0) {
+                return 0;
+            }
+            keyed = false;
+            int ret = mbedtls_ccm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, new_key.key, sizeof(miiQrKey) * 8);
+            if(ret) {
+                printMbedtlsError("setkey", ret);
+                return ret;
+            }
+            key = new_key;
+            keyed = true;
+#if defined(CCM3DS_HAVE_HW_AES)
+            use_hw_aes = ccm3dsHwAvailable();
+            if(use_hw_aes) {
+                aes128ExpandKey(key.key, &round_keys);
+            }
+#endif
+            return 0;
+        }
+
+        Result decrypt(const miiQrData* in, ver3StoreData* out) {
+            u8 decrypted_data[QR_DATA_SIZE];
+            u8 nonce[QR_PADDED_NONCE_SIZE];
+            if(!keyed) {
+                return AES_CCM_FAILED;
+            }
+            padQrNonce(&in->nonce, nonce);
+
+            int ret = ccmDecrypt(nonce, in->enc_data, decrypted_data, in->ccm_mac);
+            if(ret) {
+                printMbedtlsError("decrypt", ret);
+                return AES_CCM_FAILED;
+            }
+
+            joinQrPlaintext(decrypted_data, &in->nonce, out);
+            return 0;
+        }
+
+        Result encrypt(const ver3StoreData* in, miiQrData* out) {
+            u8 unencrypted_data[QR_DATA_SIZE];
+            u8 nonce[QR_PADDED_NONCE_SIZE];
+            if(!keyed) {
+                return AES_CCM_FAILED;
+            }
+            splitQrPlaintext(in, unencrypted_data, &out->nonce);
+            padQrNonce(&out->nonce, nonce);
+
+            int ret = ccmEncrypt(nonce, unencrypted_data, out->enc_data, out->ccm_mac);
+            if(ret) {
+                printMbedtlsError("encrypt", ret);
+                return AES_CCM_FAILED;
+            }
+            return 0;
+        }
+
+        /*
+         * Batch versions. Every entry is processed even if some fail.
+         * Per entry results are written to out_results if given, and the first failure is returned.
+         * With hardware AES, payloads go through the multi-buffer kernel CCM3DS_LANES at a time.
+         */
+        Result decrypt(const miiQrData* in, ver3StoreData* out, size_t count, Result* out_results = nullptr) {
+            Result first_fail = 0;
+            size_t i = 0;
+            if(!keyed) {
+                first_fail = AES_CCM_FAILED;
+            }
+#if defined(CCM3DS_HAVE_HW_AES)
+            else if(use_hw_aes) {
+                for(; i + CCM3DS_LANES <= count; i += CCM3DS_LANES) {
+                    Result results[CCM3DS_LANES];
+                    decryptLanes(&in[i], &out[i], results);
+                    for(int l = 0; l < CCM3DS_LANES; l++) {
+                        if(out_results) out_results[i + l] = results[l];
+                        if(R_FAILED(results[l]) && R_SUCCEEDED(first_fail)) first_fail = results[l];
+                    }
+                }
+            }
+#endif
+            for(; i < count; i++) {
+                Result res = decrypt(&in[i], &out[i]);
+                if(out_results) out_results[i] = res;
+                if(R_FAILED(res) && R_SUCCEEDED(first_fail)) first_fail = res;
+            }
+            return first_fail;
+        }
+
+        Result encrypt(const ver3StoreData* in, miiQrData* out, size_t count, Result* out_results = nullptr) {
+            Result first_fail = 0;
+            size_t i = 0;
+            if(!keyed) {
+                first_fail = AES_CCM_FAILED;
+            }
+#if defined(CCM3DS_HAVE_HW_AES)
+            else if(use_hw_aes) {
+                for(; i + CCM3DS_LANES <= count; i += CCM3DS_LANES) {
+                    encryptLanes(&in[i], &out[i]);
+                    if(out_results) {
+                        for(int l = 0; l < CCM3DS_LANES; l++) {
+                            out_results[i + l] = 0;
+                        }
+                    }
+                }
+            }
+#endif
+            for(; i < count; i++) {
+                Result res = encrypt(&in[i], &out[i]);
+                if(out_results) out_results[i] = res;
+                if(R_FAILED(res) && R_SUCCEEDED(first_fail)) first_fail = res;
+            }
+            return first_fail;
+        }
+};
+
+class MiiQrKeyManager;
+
+// Use of the key manager's shared cipher. The cipher isn't rekeyed while any lease on it is held.
+class MiiQrCipherLease {
+    friend class MiiQrKeyManager;
+    private:
+        std::shared_lock<std::shared_mutex> lock;
+        MiiQrCipher* cipher = nullptr;
+
+    public:
+        MiiQrCipherLease() = default;
+        MiiQrCipherLease(const MiiQrCipherLease&) = delete;
+        MiiQrCipherLease& operator=(const MiiQrCipherLease&) = delete;
+
+        MiiQrCipher* operator->() {
+            return cipher;
+        }
+
+        MiiQrCipher* get() {
+            return cipher;
+        }
+};
+
+/*
+ * Keeps the QR key and a cipher keyed with it in memory.
+ * The key file is only re-read when its mtime or size changes, and it is stat'ed
+ * at most once per KEY_RECHECK_INTERVAL, so bulk QR work doesn't touch the SD card.
+ * A missing or bad key file is cached the same way.
+ */
+class MiiQrKeyManager {
+    private:
+        static constexpr std::chrono::seconds KEY_RECHECK_INTERVAL{1};
+        std::string path;
+        std::mutex mutex;
+        // held shared by cipher leases, and exclusively to rekey
+        std::shared_mutex cipher_mutex;
+        MiiQrCipher cipher;
+        miiQrKey key;
+        Result key_result = MISSING_KEY_FILE;
+        bool checked = false;
+        time_t key_mtime = 0;
+        off_t key_size = -1;
+        std::chrono::steady_clock::time_point last_check;
+
+        // mutex must be held
+        void refresh() {
+            auto now = std::chrono::steady_clock::now();
+            if(checked && now - last_check < KEY_RECHECK_INTERVAL) {
+                return;
+            }
+            last_check = now;
+            struct stat st;
+            if(stat(path.c_str(), &st) != 0) {
+                checked = true;
+                key_result = MISSING_KEY_FILE;
+                key_size = -1;
+                return;
+            }
+            if(checked && st.st_mtime == key_mtime && st.st_size == key_size) {
+                return;
+            }
+            checked = true;
+            key_mtime = st.st_mtime;
+            key_size = st.st_size;
+            key_result = getMiiKeyFromTxtFile(path.c_str(), &key);
+            if(R_SUCCEEDED(key_result)) {
+                std::unique_lock<std::shared_mutex> cipher_lock(cipher_mutex);
+                if(cipher.setKey(key) != 0) {
+                    key_result = AES_CCM_FAILED;
+                }
+            }
+        }
+
+    public:
+        MiiQrKeyManager(const char* key_path) : path(key_path) {}
+        MiiQrKeyManager(const MiiQrKeyManager&) = delete;
+        MiiQrKeyManager& operator=(const MiiQrKeyManager&) = delete;
+
+        Result getKey(miiQrKey* out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            refresh();
+            if(R_SUCCEEDED(key_result)) {
+                *out = key;
+            }
+            return key_result;
+        }
+
+        /*
+         * The cipher stays owned by the manager and is rekeyed in place if the key file changes.
+         * The lease is taken before the mutex is released, so it always sees the current key.
+         */
+        Result getCipher(MiiQrCipherLease* out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            refresh();
+            if(R_SUCCEEDED(key_result)) {
+                out->lock = std::shared_lock<std::shared_mutex>(cipher_mutex);
+                out->cipher = &cipher;
+            }
+            return key_result;
+        }
+
+        // forces the next call to stat and re-read the key file
+        void invalidate() {
+            std::lock_guard<std::mutex> lock(mutex);
+            checked = false;
+        }
+};
+
+MiiQrKeyManager& getMiiQrKeyManager() {
+    static MiiQrKeyManager manager(QR_KEY_FILE_PATH);
+    return manager;
+}
+
+Result getKeyedMiiQrCipher(MiiQrCipherLease* out) {
+    return getMiiQrKeyManager().getCipher(out);
+}
+
+Result decryptMiiQrData(const miiQrData* data, ver3StoreData* out) {
+    MiiQrCipherLease cipher;
+    Result ret = getKeyedMiiQrCipher(&cipher);
+    if(R_FAILED(ret)) {
         return ret;
     }
-    return 0;
+    return cipher->decrypt(data, out);
 }
 
-// out must be size+CCM_TAG_LEN for MAC
-int aesCcmEncrypt(const void* in, void* out, const int size, const void* nonce, const int nonce_size, const void* key, const int key_size) {
-    int ret = 0;
-    mbedtls_ccm_context ctx;
-    mbedtls_ccm_init(&ctx);
-    const auto ccm_guard = sg::make_scope_guard([ctx{&ctx}]() { mbedtls_ccm_free(ctx); });
-    ret = mbedtls_ccm_setkey(&ctx,
-        MBEDTLS_CIPHER_ID_AES,
-        (unsigned char*)key,
-        key_size * 8
-    );
-    if(ret) {
-        char err[100] = {0};
-        mbedtls_strerror(ret, err, 99);
-        fprintf(stderr, "MbedTLS setkey: %s\n", err);
+Result encryptMiiQrData(const ver3StoreData* in, miiQrData* out) {
+    MiiQrCipherLease cipher;
+    Result ret = getKeyedMiiQrCipher(&cipher);
+    if(R_FAILED(ret)) {
         return ret;
     }
-    ret = mbedtls_ccm_star_encrypt_and_tag_3ds(
-        &ctx,
-        size,
-        (unsigned char*)nonce,
-        nonce_size,
-        nullptr,
-        0,
-        (unsigned char*)in,
-        (unsigned char*)out,
-        (unsigned char*)out + size,
-        CCM_TAG_LEN
-    );
-    if(ret) {
-        char err[100] = {0};
-        mbedtls_strerror(ret, err, 99);
-        fprintf(stderr, "MbedTLS encrypt: %s\n", err);
+    return cipher->encrypt(in, out);
+}
+
+// Batch versions, see MiiQrCipher
+Result decryptMiiQrData(const miiQrData* data, ver3StoreData* out, size_t count, Result* out_results = nullptr) {
+    MiiQrCipherLease cipher;
+    Result ret = getKeyedMiiQrCipher(&cipher);
+    if(R_FAILED(ret)) {
         return ret;
     }
-    return 0;
+    return cipher->decrypt(data, out, count, out_results);
 }
 
-Result decryptMiiQrData(miiQrData* data, ver3StoreData* out) {
-    int ret = 0;
-    u8 decrypted_data[QR_DATA_SIZE];
-    const int nonce_size = 8;
-    const int padded_nonce_size = 12;
-    u8 nonce[padded_nonce_size];
-    // pad nonce
-    memcpy(nonce, &data->nonce, nonce_size);
-    memset(nonce + nonce_size, 0, padded_nonce_size - nonce_size);
-
-    miiQrKey key;
-    ret = getMiiKeyFromTxtFile(QR_KEY_FILE_PATH, &key);
-    if(!R_SUCCEEDED(ret)){
+Result encryptMiiQrData(const ver3StoreData* in, miiQrData* out, size_t count, Result* out_results = nullptr) {
+    MiiQrCipherLease cipher;
+    Result ret = getKeyedMiiQrCipher(&cipher);
+    if(R_FAILED(ret)) {
         return ret;
     }
-    ret = aesCcmDecrypt(&data->enc_data, decrypted_data, QR_DATA_SIZE, &nonce, padded_nonce_size, &key, sizeof(key));
-    if(ret != 0) {
-        return AES_CCM_FAILED;
-    }
+    return cipher->encrypt(in, out, count, out_results);
+}
 
-    // insert nonce into data
-    memcpy(out, decrypted_data, padded_nonce_size);
-    memcpy((u8*)out + padded_nonce_size, nonce, nonce_size);
-    memcpy((u8*)out + padded_nonce_size + nonce_size, decrypted_data + padded_nonce_size, QR_DATA_SIZE - padded_nonce_size);
-    return 0;
+/*
+ * Decodes only the luma of a jpeg straight into dst, which is height rows of pitch bytes.
+ * Greyscale jpegs are decoded as their single Y plane with tjDecompressToYUVPlanes.
+ * Colour jpegs use TJPF_GRAY, for which libjpeg-turbo drops the chroma components before the IDCT
+ * and skips upsampling and colour conversion. Decoding those to YUV planes would IDCT the chroma too.
+ */
+int decodeJpegLuma(tjhandle handle, const u8* jpg_data, size_t jpg_size, int subsamp, u8* dst, int width, int pitch, int height, int flags) {
+    if(subsamp == TJSAMP_GRAY) {
+        u8* planes[3] = {dst, nullptr, nullptr};
+        int strides[3] = {pitch, 0, 0};
+        return tjDecompressToYUVPlanes(handle, jpg_data, jpg_size, planes, width, strides, height, flags);
+    }
+    return tjDecompress2(handle, jpg_data, jpg_size, dst, width, pitch, height, TJPF_GRAY, flags);
 }
 
-Result encryptMiiQrData(ver3StoreData* in, miiQrData* out) {
-    int ret = 0;
-    u8 unencrypted_data[QR_DATA_SIZE];
-    const int nonce_size = 8;
-    const int padded_nonce_size = 12;
-    u8 nonce[padded_nonce_size];
+/*
+ * Mii QRs are usually readable well below native resolution, so decoding starts with cheap
+ * scaled fast-DCT passes and only falls back to the full accurate decode if quirc finds nothing.
+ */
+typedef struct {
+    tjscalingfactor scale;
+    int flags;
+} qrDecodeTier;
 
-    miiQrKey key;
-    ret = getMiiKeyFromTxtFile(QR_KEY_FILE_PATH, &key);
-    if(!R_SUCCEEDED(ret)){
-        return ret;
+const qrDecodeTier QR_DECODE_TIERS[] = {
+    {{1, 4}, TJFLAG_FASTDCT},
+    {{1, 2}, TJFLAG_FASTDCT},
+    {{1, 1}, TJFLAG_ACCURATEDCT},
+};
+const int QR_DECODE_TIER_COUNT = sizeof(QR_DECODE_TIERS) / sizeof(QR_DECODE_TIERS[0]);
+// scaled tiers are skipped if the image would be smaller than this on either side
+const int QR_DECODE_MIN_SCALED_SIDE = 240;
+
+/*
+ * Finder pattern pre-filter, see qr_prefilter.h. The image is decoded at the smallest
+ * of these scales that keeps its short side at least QR_PREFILTER_MIN_SIDE.
+ * AUDIT runs the full decode anyway and counts rejected images that did have a QR.
+ */
+typedef enum {
+    QR_PREFILTER_OFF,
+    QR_PREFILTER_ON,
+    QR_PREFILTER_AUDIT,
+} qrPrefilterMode;
+
+const tjscalingfactor QR_PREFILTER_SCALES[] = {{1, 8}, {1, 4}, {1, 2}};
+const int QR_PREFILTER_MIN_SIDE = 256;
+
+// how many images were decoded at each tier, and how many no tier could decode
+typedef struct {
+    std::atomic<u32> tier_hits[QR_DECODE_TIER_COUNT];
+    std::atomic<u32> misses;
+    std::atomic<u32> prefilter_passed;
+    std::atomic<u32> prefilter_rejected;
+    std::atomic<u32> prefilter_false_negatives;
+    std::atomic<u32> cache_hits;
+} qrDecodeStats;
+
+qrDecodeStats& getQrDecodeStats() {
+    static qrDecodeStats stats;
+    return stats;
+}
+
+void printQrDecodeStats() {
+    qrDecodeStats& stats = getQrDecodeStats();
+    for(int i = 0; i < QR_DECODE_TIER_COUNT; i++) {
+        printf("QR tier %d/%d: %u\n", QR_DECODE_TIERS[i].scale.num, QR_DECODE_TIERS[i].scale.denom, stats.tier_hits[i].load());
     }
-    // seperate nonce and rest of data
-    memcpy(unencrypted_data, in, padded_nonce_size);
-    memcpy(&out->nonce, (u8*)in + padded_nonce_size, nonce_size);
-    memcpy(unencrypted_data + padded_nonce_size, (u8*)in + padded_nonce_size + nonce_size, QR_DATA_SIZE - padded_nonce_size);
-
-    // pad nonce
-    memcpy(nonce, &out->nonce, nonce_size);
-    memset(nonce + nonce_size, 0, padded_nonce_size - nonce_size);
-
-    ret = aesCcmEncrypt(unencrypted_data, &out->enc_data, QR_DATA_SIZE, &nonce, padded_nonce_size, &key, sizeof(key));
-    if(ret != 0) {
-        return AES_CCM_FAILED;
+    printf("QR misses: %u\n", stats.misses.load());
+    printf("QR cache hits: %u\n", stats.cache_hits.load());
+    u32 rejected = stats.prefilter_rejected.load();
+    if(stats.prefilter_passed.load() || rejected) {
+        printf("QR prefilter passed: %u, rejected: %u\n", stats.prefilter_passed.load(), rejected);
+        printf("QR prefilter false negatives (audit only): %u\n", stats.prefilter_false_negatives.load());
     }
-    return 0;
 }
 
-Result parseMiiQr(const char* path, ver3StoreData* out_mii) {
-    struct quirc *qr;
-    int w, h, subsamp, colorspace, err = 0;
+typedef struct {
+    Result res;
+    struct quirc_data data;
+} qrScanResult;
 
-    struct stat st;
-    stat(path, &st);
-    size_t jpg_size = st.st_size;
-    std::unique_ptr<u8[]> jpg_data(new u8[jpg_size]);
-
-    FILE* jpg_file = fopen(path, "r");
-    fread(jpg_data.get(), 1, jpg_size, jpg_file);
-    fclose(jpg_file);
-
-    tjhandle handle = tjInitDecompress();
-    if(handle == nullptr) {
-        printf("tjInitDecompress failed\n");
-        return JPEG_DECODE_FAIL;
-    }
-    const auto tj_init_guard = sg::make_scope_guard([handle]() { tjDestroy(handle); });
+// one per QR code found in an image
+typedef struct {
+    Result res;
+    ver3StoreData mii;
+} miiQrDecodeResult;
 
-    err = tjDecompressHeader3(handle, jpg_data.get(), jpg_size, &w, &h, &subsamp, &colorspace);
-    if(err != 0) {
-        printf("tjDecompressHeader3 error\n");
-        return JPEG_DECODE_FAIL;
-    }
+/*
+ * Keeps a turbojpeg handle and one quirc per decode tier alive between images.
+ * quirc_resize always reallocates, so a tier's quirc is only resized when that tier's
+ * image size changes. Folders of same-sized photos or screenshots reuse every buffer.
+ * Has its own cipher, keyed from the key manager. Not thread safe, see MiiQrDecoderPool.
+ */
+class MiiQrDecoder {
+    private:
+        tjhandle handle = nullptr;
+        struct quirc* qrs[QR_DECODE_TIER_COUNT] = {};
+        int qr_widths[QR_DECODE_TIER_COUNT] = {};
+        int qr_heights[QR_DECODE_TIER_COUNT] = {};
+        MiiQrCipher cipher;
+        // kept between images so their capacity is reused
+        std::vector<qrScanResult> scan_results;
+        std::vector<qrScanResult> best_results;
+        std::vector<miiQrData> payloads;
+        std::vector<ver3StoreData> decrypted;
+        std::vector<Result> decrypt_results;
+        qrPrefilterMode prefilter = QR_PREFILTER_OFF;
+        bool last_prefilter_rejected = false;
+        std::vector<u8> prefilter_image;
 
-    qr = quirc_new();
-    const auto quirc_new_guard = sg::make_scope_guard([qr]() { quirc_destroy(qr); });
-    if (!qr) {
-        printf("Failed to allocate memory for QR\n");
-        return QR_DECODE_FAIL;
-    }
-    if (quirc_resize(qr, w, h) < 0) {
-        printf("Failed to allocate memory for QR resize\n");
-        return QR_DECODE_FAIL;
-    }
+        // false if the image clearly has no QR. Errors pass so the full decode can report them.
+        bool prefilterPasses(const u8* jpg_data, size_t jpg_size, int subsamp, int w, int h) {
+            tjscalingfactor scale = {1, 1};
+            for(const tjscalingfactor& s : QR_PREFILTER_SCALES) {
+                if(TJSCALED(w, s) >= QR_PREFILTER_MIN_SIDE && TJSCALED(h, s) >= QR_PREFILTER_MIN_SIDE) {
+                    scale = s;
+                    break;
+                }
+            }
+            if(scale.denom == 1) {
+                return true;
+            }
+            int scaled_w = TJSCALED(w, scale);
+            int scaled_h = TJSCALED(h, scale);
+            prefilter_image.resize((size_t)scaled_w * scaled_h);
+            if(decodeJpegLuma(handle, jpg_data, jpg_size, subsamp, prefilter_image.data(), scaled_w, scaled_w, scaled_h, TJFLAG_FASTDCT) != 0) {
+                return true;
+            }
+            return qrPrefilterPasses(prefilter_image.data(), scaled_w, scaled_h, scaled_w);
+        }
 
-    {
-        int w, h;
-        u8 *image = quirc_begin(qr, &w, &h);
-        err = tjDecompress2(handle, jpg_data.get(), jpg_size, image, w, w, h, TJPF_GRAY, TJFLAG_ACCURATEDCT);
-        quirc_end(qr);
-        if(err != 0) {
-            printf("tjDecompress2 error\n");
-            return JPEG_DECODE_FAIL;
+        // Returns the tier's quirc, sized for a w by h image
+        struct quirc* getQuirc(int tier, int w, int h) {
+            if(!qrs[tier]) {
+                qrs[tier] = quirc_new();
+                if(!qrs[tier]) {
+                    printf("Failed to allocate memory for QR\n");
+                    return nullptr;
+                }
+            }
+            if(qr_widths[tier] != w || qr_heights[tier] != h) {
+                if (quirc_resize(qrs[tier], w, h) < 0) {
+                    printf("Failed to allocate memory for QR resize\n");
+                    qr_widths[tier] = qr_heights[tier] = 0;
+                    return nullptr;
+                }
+                qr_widths[tier] = w;
+                qr_heights[tier] = h;
+            }
+            return qrs[tier];
         }
-    }
 
-    if (quirc_count(qr) == 0) {
-        return NO_QR;
-    }
-    else {
-        struct quirc_code code;
-        struct quirc_data data;
-        quirc_decode_error_t err;
+        /*
+         * Decodes the jpeg at one tier and fills scan_results with the codes quirc found,
+         * stopping at the first one that decodes if first_only is set.
+         * Codes whose payload isn't the size of a Mii QR fail with QR_DECODE_FAIL,
+         * so only succeeded results can be read as miiQrData.
+         */
+        Result scanTier(const u8* jpg_data, size_t jpg_size, int subsamp, int w, int h, int tier, bool first_only) {
+            const qrDecodeTier& t = QR_DECODE_TIERS[tier];
+            scan_results.clear();
+            struct quirc* qr = getQuirc(tier, TJSCALED(w, t.scale), TJSCALED(h, t.scale));
+            if(!qr) {
+                return QR_DECODE_FAIL;
+            }
 
-        quirc_extract(qr, 0, &code);
+            {
+                int w, h;
+                u8 *image = quirc_begin(qr, &w, &h);
+                int err = decodeJpegLuma(handle, jpg_data, jpg_size, subsamp, image, w, w, h, t.flags);
+                quirc_end(qr);
+                if(err != 0) {
+                    printf("jpeg luma decode error: %s\n", tjGetErrorStr2(handle));
+                    return JPEG_DECODE_FAIL;
+                }
+            }
+
+            int count = quirc_count(qr);
+            if (count == 0) {
+                return NO_QR;
+            }
+            scan_results.reserve(count);
+            for(int i = 0; i < count; i++) {
+                struct quirc_code code;
+                scan_results.emplace_back();
+                qrScanResult& result = scan_results.back();
+                quirc_extract(qr, i, &code);
+                quirc_decode_error_t err = quirc_decode(&code, &result.data);
+                if (err != 0) {
+                    printf("QR decode failed: %s\n", quirc_strerror(err));
+                    result.res = QR_DECODE_FAIL;
+                    continue;
+                }
+                if(result.data.payload_len != sizeof(miiQrData)) {
+                    printf("QR is not a Mii: %d byte payload\n", result.data.payload_len);
+                    result.res = QR_DECODE_FAIL;
+                    continue;
+                }
+                result.res = 0;
+                if(first_only) {
+                    break;
+                }
+            }
+            return 0;
+        }
+
+        /*
+         * Runs the decode tiers until one decodes every code it finds, or any code if first_only is set.
+         * Leaves the codes from the tier that decoded the most in best_results.
+         */
+        Result scan(const u8* jpg_data, size_t jpg_size, bool first_only, int* out_tier) {
+            int w, h, subsamp, colorspace;
+            best_results.clear();
+            if(out_tier) {
+                *out_tier = -1;
+            }
+            if(!handle) {
+                handle = tjInitDecompress();
+                if(handle == nullptr) {
+                    printf("tjInitDecompress failed\n");
+                    return JPEG_DECODE_FAIL;
+                }
+            }
+
+            if(tjDecompressHeader3(handle, jpg_data, jpg_size, &w, &h, &subsamp, &colorspace) != 0) {
+                printf("tjDecompressHeader3 error\n");
+                return JPEG_DECODE_FAIL;
+            }
+
+            bool rejected = false;
+            last_prefilter_rejected = false;
+            if(prefilter != QR_PREFILTER_OFF) {
+                rejected = !prefilterPasses(jpg_data, jpg_size, subsamp, w, h);
+                last_prefilter_rejected = rejected;
+                if(rejected) {
+                    getQrDecodeStats().prefilter_rejected++;
+                    if(prefilter == QR_PREFILTER_ON) {
+                        getQrDecodeStats().misses++;
+                        return NO_QR;
+                    }
+                }
+                else {
+                    getQrDecodeStats().prefilter_passed++;
+                }
+            }
+
+            Result res = NO_QR;
+            int best_tier = -1;
+            size_t best_decoded = 0;
+            for(int tier = 0; tier < QR_DECODE_TIER_COUNT; tier++) {
+                const qrDecodeTier& t = QR_DECODE_TIERS[tier];
+                bool last = tier == QR_DECODE_TIER_COUNT - 1;
+                if(!last && (TJSCALED(w, t.scale) < QR_DECODE_MIN_SCALED_SIDE || TJSCALED(h, t.scale) < QR_DECODE_MIN_SCALED_SIDE)) {
+                    continue;
+                }
+                Result tier_res = scanTier(jpg_data, jpg_size, subsamp, w, h, tier, first_only);
+                if(R_FAILED(tier_res)) {
+                    if(best_tier < 0) {
+                        res = tier_res;
+                    }
+                    continue;
+                }
+                size_t found = scan_results.size();
+                size_t decoded = 0;
+                for(const qrScanResult& result : scan_results) {
+                    if(R_SUCCEEDED(result.res)) {
+                        decoded++;
+                    }
+                }
+                if(best_tier < 0 || decoded > best_decoded) {
+                    best_tier = tier;
+                    best_decoded = decoded;
+                    best_results.swap(scan_results);
+                }
+                // scan_results may have been swapped into best_results, so use this tier's count
+                if(decoded > 0 && (first_only || decoded == found)) {
+                    break;
+                }
+            }
+
+            if(best_tier < 0 || best_decoded == 0) {
+                getQrDecodeStats().misses++;
+                return best_tier < 0 ? res : QR_DECODE_FAIL;
+            }
+            getQrDecodeStats().tier_hits[best_tier]++;
+            if(rejected) {
+                getQrDecodeStats().prefilter_false_negatives++;
+            }
+            if(out_tier) {
+                *out_tier = best_tier;
+            }
+            return 0;
+        }
+
+        Result keyCipher() {
+            miiQrKey key;
+            Result res = getMiiQrKeyManager().getKey(&key);
+            if(R_FAILED(res)) {
+                return res;
+            }
+            if(cipher.setKey(key) != 0) {
+                return AES_CCM_FAILED;
+            }
+            return 0;
+        }
+
+    public:
+        MiiQrDecoder() = default;
+        MiiQrDecoder(const MiiQrDecoder&) = delete;
+        MiiQrDecoder& operator=(const MiiQrDecoder&) = delete;
+        ~MiiQrDecoder() {
+            for(struct quirc* qr : qrs) {
+                if(qr) {
+                    quirc_destroy(qr);
+                }
+            }
+            if(handle) {
+                tjDestroy(handle);
+            }
+        }
+
+        // Off by default, as a single image the user picked shouldn't risk a false negative
+        void setPrefilter(qrPrefilterMode mode) {
+            prefilter = mode;
+        }
+
+        // whether the last image was turned down by the pre-filter rather than fully decoded
+        bool wasPrefilterRejected() const {
+            return last_prefilter_rejected;
+        }
 
-        err = quirc_decode(&code, &data);
-        if (err != 0) {
-            printf("QR decode failed: %s\n", quirc_strerror(err));
+        // Decodes the first readable QR. out_tier is set to the index into QR_DECODE_TIERS that found it, or -1
+        Result decode(const u8* jpg_data, size_t jpg_size, ver3StoreData* out_mii, int* out_tier = nullptr) {
+            Result res = scan(jpg_data, jpg_size, true, out_tier);
+            if(R_FAILED(res)) {
+                return res;
+            }
+            res = keyCipher();
+            if(R_FAILED(res)) {
+                return res;
+            }
+            for(const qrScanResult& result : best_results) {
+                if(R_SUCCEEDED(result.res)) {
+                    return cipher.decrypt((const miiQrData*)result.data.payload, out_mii);
+                }
+            }
             return QR_DECODE_FAIL;
         }
-        else {        
-            Result res = decryptMiiQrData((miiQrData*)data.payload, out_mii);
+
+        /*
+         * Decodes and decrypts every QR in the image from one jpeg decode pass.
+         * out gets one entry per code found, with its own status.
+         * Returns 0 if at least one Mii was decoded, otherwise the first failure.
+         */
+        Result decodeAll(const u8* jpg_data, size_t jpg_size, std::vector<miiQrDecodeResult>& out, int* out_tier = nullptr) {
+            out.clear();
+            Result res = scan(jpg_data, jpg_size, false, out_tier);
             if(R_FAILED(res)) {
                 return res;
             }
+            out.resize(best_results.size());
+            Result key_res = keyCipher();
+
+            payloads.clear();
+            for(size_t i = 0; i < best_results.size(); i++) {
+                out[i].res = best_results[i].res;
+                if(R_SUCCEEDED(out[i].res)) {
+                    if(R_FAILED(key_res)) {
+                        out[i].res = key_res;
+                        continue;
+                    }
+                    payloads.push_back(*(const miiQrData*)best_results[i].data.payload);
+                }
+            }
+            // decrypt together so the multi-buffer path can be used
+            decrypted.resize(payloads.size());
+            decrypt_results.resize(payloads.size());
+            cipher.decrypt(payloads.data(), decrypted.data(), payloads.size(), decrypt_results.data());
+
+            Result first_fail = 0;
+            bool any_decoded = false;
+            size_t p = 0;
+            for(miiQrDecodeResult& result : out) {
+                if(R_SUCCEEDED(result.res)) {
+                    result.res = decrypt_results[p];
+                    result.mii = decrypted[p];
+                    p++;
+                }
+                if(R_SUCCEEDED(result.res)) {
+                    any_decoded = true;
+                }
+                else if(R_SUCCEEDED(first_fail)) {
+                    first_fail = result.res;
+                }
+            }
+            return any_decoded ? 0 : first_fail;
         }
-    }
 
-    return 0;
+        Result decodeAll(const char* path, std::vector<miiQrDecodeResult>& out, int* out_tier = nullptr) {
+            out.clear();
+            if(out_tier) {
+                *out_tier = -1;
+            }
+            FileInput jpg;
+            Result res = jpg.open(path);
+            if(R_FAILED(res)) {
+                return res;
+            }
+            return decodeAll(jpg.getData(), jpg.getSize(), out, out_tier);
+        }
+
+        Result decode(const char* path, ver3StoreData* out_mii, int* out_tier = nullptr) {
+            if(out_tier) {
+                *out_tier = -1;
+            }
+            FileInput jpg;
+            Result res = jpg.open(path);
+            if(R_FAILED(res)) {
+                return res;
+            }
+            return decode(jpg.getData(), jpg.getSize(), out_mii, out_tier);
+        }
+};
+
+// Hands out decoders to any thread, keeping up to MAX_IDLE of them around for reuse.
+class MiiQrDecoderPool {
+    private:
+        static const size_t MAX_IDLE = 4;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<MiiQrDecoder>> idle;
+
+    public:
+        std::unique_ptr<MiiQrDecoder> acquire() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(idle.empty()) {
+                return std::unique_ptr<MiiQrDecoder>(new MiiQrDecoder());
+            }
+            std::unique_ptr<MiiQrDecoder> decoder = std::move(idle.back());
+            idle.pop_back();
+            return decoder;
+        }
+
+        void release(std::unique_ptr<MiiQrDecoder> decoder) {
+            decoder->setPrefilter(QR_PREFILTER_OFF);
+            std::lock_guard<std::mutex> lock(mutex);
+            if(idle.size() < MAX_IDLE) {
+                idle.push_back(std::move(decoder));
+            }
+        }
+};
+
+MiiQrDecoderPool& getMiiQrDecoderPool() {
+    static MiiQrDecoderPool pool;
+    return pool;
 }
 
-std::unique_ptr<u32[]> generateQrRGBA(u8 *data, size_t data_size, u32 scale, int* out_width) {
-    using qrcodegen::QrCode;
-    std::vector<u8> data_vec(data, data+data_size);
-    const QrCode qr = QrCode::encodeBinary(data_vec, QrCode::Ecc::HIGH);
-    int qr_size = qr.getSize();
-    const int border = 2;
-    int width = border*2 + qr_size;
-    *out_width = width*scale;
-    size_t arr_size = *out_width * *out_width;
-    std::unique_ptr<u32[]> out_data(new u32[arr_size]);
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < width; y++) {
-            bool black_square = qr.getModule(x-border, y-border);
-            for (u32 scale_x=0; scale_x<scale; scale_x++) {
-                for (u32 scale_y=0; scale_y<scale; scale_y++) {
-                    size_t pos = (y*scale+scale_y)*width*scale + (x*scale+scale_x);
-                    if(pos < arr_size) {
-                        if(black_square) {
-                            // black
-                            out_data[pos] = 0xFF000000;
-                        }
-                        else {
-                            // white
-                            out_data[pos] = 0xFFFFFFFF;
+// A decoder borrowed from a pool for the lifetime of this object
+class MiiQrDecoderLease {
+    private:
+        MiiQrDecoderPool& pool;
+        std::unique_ptr<MiiQrDecoder> decoder;
+
+    public:
+        MiiQrDecoderLease(MiiQrDecoderPool& from = getMiiQrDecoderPool()) : pool(from), decoder(from.acquire()) {}
+        MiiQrDecoderLease(const MiiQrDecoderLease&) = delete;
+        MiiQrDecoderLease& operator=(const MiiQrDecoderLease&) = delete;
+        ~MiiQrDecoderLease() {
+            pool.release(std::move(decoder));
+        }
+
+        MiiQrDecoder* operator->() {
+            return decoder.get();
+        }
+
+        MiiQrDecoder* get() {
+            return decoder.get();
+        }
+};
+
+const char* QR_CACHE_FILE_PATH = "/MiiPort/qrcache.bin";
+const u32 QR_CACHE_MAGIC = 0x4351504d; // "MPQC"
+const u32 QR_CACHE_VERSION = 1;
+const size_t QR_CACHE_MAX_ENTRIES = 4096;
+// most Miis kept for one image
+const u32 QR_CACHE_MAX_MIIS = 256;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    // hash of the QR key the results were decrypted with
+    u64 key_hash;
+} miiQrCacheHeader;
+
+// followed by mii_count ver3StoreData in the file
+typedef struct {
+    u64 path_hash;
+    u64 content_hash;
+    u64 size;
+    s64 mtime;
+    Result res;
+    u32 mii_count;
+} miiQrCacheRecord;
+
+typedef struct {
+    miiQrCacheRecord record;
+    std::vector<ver3StoreData> miis;
+} miiQrCacheEntry;
+
+/*
+ * Persistent cache of QR decode results, so images that were already scanned
+ * don't go through jpeg decoding, quirc and decryption again.
+ * Entries are found by path hash, size and mtime without reading the image,
+ * or by content hash and size if the file was moved or touched.
+ * Records are appended to the cache file, which is rewritten when the QR key changes
+ * or it grows past QR_CACHE_MAX_ENTRIES.
+ */
+class MiiQrDecodeCache {
+    private:
+        std::string path;
+        std::mutex mutex;
+        bool loaded = false;
+        u64 key_hash = 0;
+        std::vector<miiQrCacheEntry> entries;
+        std::unordered_map<u64, size_t> by_path;
+        std::unordered_map<u64, size_t> by_content;
+        FILE* file = nullptr;
+
+        void index(size_t i) {
+            by_path[entries[i].record.path_hash] = i;
+            by_content[entries[i].record.content_hash] = i;
+        }
+
+        void clear() {
+            entries.clear();
+            by_path.clear();
+            by_content.clear();
+        }
+
+        bool writeEntry(FILE* out, const miiQrCacheEntry& entry) {
+            return fwrite(&entry.record, sizeof(entry.record), 1, out) == 1 &&
+                fwrite(entry.miis.data(), sizeof(ver3StoreData), entry.miis.size(), out) == entry.miis.size();
+        }
+
+        void closeFile() {
+            if(file) {
+                fclose(file);
+                file = nullptr;
+            }
+        }
+
+        // Writes the header and every entry, leaving the file open for appending.
+        void rewrite() {
+            closeFile();
+            file = fopen(path.c_str(), "wb");
+            if(!file) {
+                printf("QR cache open error: %d\n", errno);
+                return;
+            }
+            miiQrCacheHeader header = {QR_CACHE_MAGIC, QR_CACHE_VERSION, key_hash};
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            for(const miiQrCacheEntry& entry : entries) {
+                ok = ok && writeEntry(file, entry);
+            }
+            if(!ok) {
+                printf("QR cache write error\n");
+                closeFile();
+            }
+        }
+
+        /*
+         * Reads the cache file and leaves it open for appending.
+         * It is only rewritten if it is missing, for another key or version, or has a bad
+         * or truncated record, which is dropped along with anything after it.
+         */
+        void load() {
+            clear();
+            bool intact = false;
+            FILE* in = fopen(path.c_str(), "rb");
+            if(in) {
+                miiQrCacheHeader header;
+                if(fread(&header, sizeof(header), 1, in) == 1 && header.magic == QR_CACHE_MAGIC &&
+                    header.version == QR_CACHE_VERSION && header.key_hash == key_hash) {
+                    long good_end = ftell(in);
+                    miiQrCacheEntry entry;
+                    while(fread(&entry.record, sizeof(entry.record), 1, in) == 1 && entry.record.mii_count <= QR_CACHE_MAX_MIIS) {
+                        entry.miis.resize(entry.record.mii_count);
+                        if(fread(entry.miis.data(), sizeof(ver3StoreData), entry.miis.size(), in) != entry.miis.size()) {
+                            break;
                         }
+                        entries.push_back(entry);
+                        index(entries.size() - 1);
+                        good_end = ftell(in);
                     }
-                    else {
-                        printf("qr tried to write out of bounds\n");
-                    }
+                    intact = fseek(in, 0, SEEK_END) == 0 && ftell(in) == good_end;
+                }
+                fclose(in);
+            }
+            if(intact) {
+                file = fopen(path.c_str(), "ab");
+                if(!file) {
+                    printf("QR cache open error: %d\n", errno);
+                }
+            }
+            else {
+                rewrite();
+            }
+        }
+
+        // mutex must be held. Returns false if there is no usable key, in which case nothing is cached.
+        bool syncKey() {
+            miiQrKey key;
+            if(R_FAILED(getMiiQrKeyManager().getKey(&key))) {
+                return false;
+            }
+            u64 hash = hash64(&key, sizeof(key));
+            if(!loaded || hash != key_hash) {
+                key_hash = hash;
+                if(!loaded) {
+                    load();
+                    loaded = true;
                 }
+                else {
+                    clear();
+                    rewrite();
+                }
+            }
+            return true;
+        }
+
+        bool found(const std::unordered_map<u64, size_t>& map, u64 hash, u64 size, const s64* mtime, std::vector<miiQrDecodeResult>& out, Result* out_res) {
+            auto it = map.find(hash);
+            if(it == map.end()) {
+                return false;
+            }
+            const miiQrCacheEntry& entry = entries[it->second];
+            if(entry.record.size != size || (mtime && entry.record.mtime != *mtime)) {
+                return false;
+            }
+            out.clear();
+            for(const ver3StoreData& mii : entry.miis) {
+                out.push_back({0, mii});
             }
+            *out_res = entry.record.res;
+            return true;
         }
-	}
+
+    public:
+        MiiQrDecodeCache(const char* cache_path) : path(cache_path) {}
+        MiiQrDecodeCache(const MiiQrDecodeCache&) = delete;
+        MiiQrDecodeCache& operator=(const MiiQrDecodeCache&) = delete;
+        ~MiiQrDecodeCache() {
+            closeFile();
+        }
+
+        bool findByPath(u64 path_hash, u64 size, s64 mtime, std::vector<miiQrDecodeResult>& out, Result* out_res) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return syncKey() && found(by_path, path_hash, size, &mtime, out, out_res);
+        }
+
+        bool findByContent(u64 content_hash, u64 size, std::vector<miiQrDecodeResult>& out, Result* out_res) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return syncKey() && found(by_content, content_hash, size, nullptr, out, out_res);
+        }
+
+        // Only successful Miis are kept from results
+        void store(const miiQrCacheRecord& record, const std::vector<miiQrDecodeResult>& results) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!syncKey()) {
+                return;
+            }
+            miiQrCacheEntry entry = {record, {}};
+            for(const miiQrDecodeResult& result : results) {
+                if(R_SUCCEEDED(result.res) && entry.miis.size() < QR_CACHE_MAX_MIIS) {
+                    entry.miis.push_back(result.mii);
+                }
+            }
+            entry.record.mii_count = entry.miis.size();
+            entries.push_back(std::move(entry));
+            index(entries.size() - 1);
+            if(entries.size() > QR_CACHE_MAX_ENTRIES) {
+                // keep the newer half
+                entries.erase(entries.begin(), entries.begin() + entries.size() / 2);
+                by_path.clear();
+                by_content.clear();
+                for(size_t i = 0; i < entries.size(); i++) {
+                    index(i);
+                }
+                rewrite();
+            }
+            else if(file && !writeEntry(file, entries.back())) {
+                printf("QR cache write error\n");
+                closeFile();
+            }
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(file) {
+                fflush(file);
+            }
+        }
+};
+
+MiiQrDecodeCache& getMiiQrDecodeCache() {
+    static MiiQrDecodeCache cache(QR_CACHE_FILE_PATH);
+    return cache;
+}
+
+/*
+ * decodeAll through the decode cache. Successes and "no QR" verdicts are cached,
+ * but not pre-filter rejections or errors that might not happen again.
+ * out_tier is -1 for cached results.
+ */
+Result decodeAllMiiQrsCached(MiiQrDecoder* decoder, const char* path, std::vector<miiQrDecodeResult>& out, int* out_tier = nullptr) {
+    if(out_tier) {
+        *out_tier = -1;
+    }
+    struct stat st;
+    if(stat(path, &st) != 0) {
+        return FILE_READ_FAIL;
+    }
+    MiiQrDecodeCache& cache = getMiiQrDecodeCache();
+    miiQrCacheRecord record = {hash64(path, strlen(path)), 0, (u64)st.st_size, (s64)st.st_mtime, 0, 0};
+    Result res;
+    if(cache.findByPath(record.path_hash, record.size, record.mtime, out, &res)) {
+        getQrDecodeStats().cache_hits++;
+        return res;
+    }
+
+    FileInput jpg;
+    res = jpg.open(path);
+    if(R_FAILED(res)) {
+        return res;
+    }
+    record.content_hash = hash64(jpg.getData(), jpg.getSize());
+    if(cache.findByContent(record.content_hash, record.size, out, &res)) {
+        getQrDecodeStats().cache_hits++;
+        // remember the new path too
+        record.res = res;
+        cache.store(record, out);
+        return res;
+    }
+
+    res = decoder->decodeAll(jpg.getData(), jpg.getSize(), out, out_tier);
+    if(R_SUCCEEDED(res) || (res == NO_QR && !decoder->wasPrefilterRejected())) {
+        record.res = res;
+        cache.store(record, out);
+    }
+    return res;
+}
+
+// out_tier is set to the index into QR_DECODE_TIERS that found the QR, or -1
+Result parseMiiQr(const char* path, ver3StoreData* out_mii, int* out_tier = nullptr) {
+    MiiQrDecoderLease decoder;
+    std::vector<miiQrDecodeResult> results;
+    Result res = decodeAllMiiQrsCached(decoder.get(), path, results, out_tier);
+    getMiiQrDecodeCache().flush();
+    if(R_FAILED(res)) {
+        return res;
+    }
+    for(const miiQrDecodeResult& result : results) {
+        if(R_SUCCEEDED(result.res)) {
+            *out_mii = result.mii;
+            return 0;
+        }
+    }
+    return NO_QR;
+}
+
+// Every QR in the image, see MiiQrDecoder::decodeAll
+Result parseAllMiiQrs(const char* path, std::vector<miiQrDecodeResult>& out, int* out_tier = nullptr) {
+    MiiQrDecoderLease decoder;
+    Result res = decodeAllMiiQrsCached(decoder.get(), path, out, out_tier);
+    getMiiQrDecodeCache().flush();
+    return res;
+}
+
+const u32 QR_RGBA_BLACK = 0xFF000000;
+const u32 QR_RGBA_WHITE = 0xFFFFFFFF;
+// quiet zone around generated QRs, in modules
+const int QR_BORDER = 2;
+
+// Writes count copies of colour, 4 pixels per store where possible so it compiles to vector stores
+void fillPixels(u32* dst, size_t count, u32 colour) {
+    const u32 quad[4] = {colour, colour, colour, colour};
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        memcpy(dst + i, quad, sizeof(quad));
+    }
+    for(; i < count; i++) {
+        dst[i] = colour;
+    }
+}
+
+// Pixel formats rasterizeQr can write
+typedef enum {
+    // 1 bit per pixel, most significant bit first, set for black
+    QR_PIXEL_1BPP,
+    // 1 byte per pixel, 0x00 for black and 0xFF for white
+    QR_PIXEL_GREY8,
+    // QR_RGBA_BLACK and QR_RGBA_WHITE
+    QR_PIXEL_RGBA,
+} qrPixelFormat;
+
+// smallest row pitch in bytes for width pixels
+size_t qrPixelPitch(qrPixelFormat format, int width) {
+    switch(format) {
+        case QR_PIXEL_1BPP:
+            return (width + 7) / 8;
+        case QR_PIXEL_GREY8:
+            return width;
+        default:
+            return (size_t)width * sizeof(u32);
+    }
+}
+
+// Sets or clears count bits of an MSB first bit row, starting at bit from
+void fillBits(u8* row, size_t from, size_t count, bool set) {
+    size_t end = from + count;
+    while(from < end && from % 8 != 0) {
+        u8 bit = 0x80 >> (from % 8);
+        row[from / 8] = set ? row[from / 8] | bit : row[from / 8] & ~bit;
+        from++;
+    }
+    size_t whole = (end - from) / 8;
+    memset(row + from / 8, set ? 0xFF : 0x00, whole);
+    from += whole * 8;
+    for(; from < end; from++) {
+        u8 bit = 0x80 >> (from % 8);
+        row[from / 8] = set ? row[from / 8] | bit : row[from / 8] & ~bit;
+    }
+}
+
+// Fills count pixels of a row starting at pixel from
+void fillQrPixels(u8* row, qrPixelFormat format, size_t from, size_t count, bool black) {
+    switch(format) {
+        case QR_PIXEL_1BPP:
+            fillBits(row, from, count, black);
+            break;
+        case QR_PIXEL_GREY8:
+            memset(row + from, black ? 0x00 : 0xFF, count);
+            break;
+        default:
+            fillPixels((u32*)row + from, count, black ? QR_RGBA_BLACK : QR_RGBA_WHITE);
+            break;
+    }
+}
+
+/*
+ * Draws a QR symbol with border modules of white around it into a caller supplied out_size square image.
+ * Qr is anything with getSize() and QrCode style packed rows from getRow().
+ * Modules are scaled by nearest neighbour, so out_size can be anything, but a multiple of
+ * getSize() + 2*border keeps every module the same size.
+ * Each output line is drawn as spans of same coloured modules, and lines from the same
+ * module row are copied from the one above.
+ */
+template <typename Qr>
+void rasterizeQr(const Qr& qr, int border, int out_size, qrPixelFormat format, u8* dst, size_t pitch) {
+    int qr_size = qr.getSize();
+    int words_per_row = (qr_size + 63) / 64;
+    int modules = qr_size + border*2;
+    size_t line_bytes = qrPixelPitch(format, out_size);
+    // first pixel of module m, counting the border
+    auto moduleStart = [&](int m) {
+        return ((size_t)m * out_size + modules - 1) / modules;
+    };
+    int last_row = -1;
+    for(int y = 0; y < out_size; y++) {
+        u8* line = dst + (size_t)y * pitch;
+        int module_row = (int)((size_t)y * modules / out_size) - border;
+        if(y > 0 && module_row == last_row) {
+            memcpy(line, line - pitch, line_bytes);
+            continue;
+        }
+        last_row = module_row;
+        if(module_row < 0 || module_row >= qr_size) {
+            fillQrPixels(line, format, 0, out_size, false);
+            continue;
+        }
+        const uint64_t* row = qr.getRow(module_row);
+        fillQrPixels(line, format, 0, moduleStart(border), false);
+        for(int x = 0; x < qr_size;) {
+            int end = bitRowNextEdge(row, words_per_row, qr_size, x);
+            bool black = (row[x / 64] >> (x % 64)) & 1;
+            size_t start = moduleStart(border + x);
+            fillQrPixels(line, format, start, moduleStart(border + end) - start, black);
+            x = end;
+        }
+        size_t right = moduleStart(border + qr_size);
+        fillQrPixels(line, format, right, out_size - right, false);
+    }
+}
+
+// Draws a QR symbol into a new RGBA image with each module scale pixels square, see rasterizeQr
+template <typename Qr>
+std::unique_ptr<u32[]> drawQrRGBA(const Qr& qr, u32 scale, int* out_width, int border = QR_BORDER) {
+    int width = (qr.getSize() + border*2) * scale;
+    *out_width = width;
+    std::unique_ptr<u32[]> out_data(new u32[(size_t)width * width]);
+    rasterizeQr(qr, border, width, QR_PIXEL_RGBA, (u8*)out_data.get(), (size_t)width * sizeof(u32));
     return out_data;
 }
 
-Result generateMiiQr(ver3StoreData* in, u32 scale, int* out_width, std::unique_ptr<u32[]> &out) {
-    Result ret;
+// Encoder for the one shape of QR a Mii makes, see qrcodegen::FixedQrEncoder
+typedef qrcodegen::FixedQrEncoder<sizeof(miiQrData), qrcodegen::QrCode::Ecc::HIGH> MiiQrEncoder;
+typedef MiiQrEncoder::Symbol miiQrSymbol;
+
+void encodeMiiQr(const miiQrData& data, miiQrSymbol* out) {
+    MiiQrEncoder::encode((const u8*)&data, *out);
+}
+
+// Encrypts and encodes a Mii into a packed 1 bit per module symbol, to be drawn with rasterizeQr
+Result generateMiiQr(ver3StoreData* in, miiQrSymbol* out) {
     miiQrData data;
-    ret = encryptMiiQrData(in, &data);
+    Result ret = encryptMiiQrData(in, &data);
+    if(R_SUCCEEDED(ret)) {
+        encodeMiiQr(data, out);
+    }
+    return ret;
+}
+
+const size_t QR_IMAGE_CACHE_MAX_ENTRIES = 32;
+
+typedef struct {
+    u8 create_id[10];
+    u64 content_hash;
+    // the payload is encrypted, so a new QR key means a different QR
+    u64 key_hash;
+} miiQrImageKey;
+
+/*
+ * In memory LRU cache of generated Mii QRs, so showing the same Mii again skips encryption and encoding.
+ * Entries are the packed symbols, which are only a few hundred bytes, rather than scaled pixels.
+ * Only useful for ver3StoreData with stable IDs, see charInfoToVer3StoreData's deterministic mode.
+ */
+class MiiQrImageCache {
+    private:
+        typedef std::pair<miiQrImageKey, miiQrSymbol> entry;
+        std::mutex mutex;
+        // most recently used first
+        std::list<entry> entries;
+        std::unordered_map<u64, std::list<entry>::iterator> by_key;
+
+        static u64 hashKey(const miiQrImageKey& key) {
+            return hash64(&key, sizeof(key));
+        }
+
+        static bool sameKey(const miiQrImageKey& a, const miiQrImageKey& b) {
+            return memcmp(&a, &b, sizeof(miiQrImageKey)) == 0;
+        }
+
+    public:
+        MiiQrImageCache() = default;
+        MiiQrImageCache(const MiiQrImageCache&) = delete;
+        MiiQrImageCache& operator=(const MiiQrImageCache&) = delete;
+
+        bool find(const miiQrImageKey& key, miiQrSymbol* out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = by_key.find(hashKey(key));
+            if(it == by_key.end() || !sameKey(it->second->first, key)) {
+                return false;
+            }
+            entries.splice(entries.begin(), entries, it->second);
+            *out = it->second->second;
+            return true;
+        }
+
+        void store(const miiQrImageKey& key, const miiQrSymbol& symbol) {
+            std::lock_guard<std::mutex> lock(mutex);
+            u64 hash = hashKey(key);
+            auto it = by_key.find(hash);
+            if(it != by_key.end()) {
+                entries.erase(it->second);
+                by_key.erase(it);
+            }
+            entries.emplace_front(key, symbol);
+            by_key[hash] = entries.begin();
+            if(entries.size() > QR_IMAGE_CACHE_MAX_ENTRIES) {
+                by_key.erase(hashKey(entries.back().first));
+                entries.pop_back();
+            }
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+            by_key.clear();
+        }
+};
+
+MiiQrImageCache& getMiiQrImageCache() {
+    static MiiQrImageCache cache;
+    return cache;
+}
+
+// generateMiiQr through the image cache
+Result generateMiiQrCached(ver3StoreData* in, miiQrSymbol* out) {
+    miiQrKey qr_key;
+    Result ret = getMiiQrKeyManager().getKey(&qr_key);
+    if(R_FAILED(ret)) {
+        return ret;
+    }
+    miiQrImageKey key;
+    // zeroed so padding doesn't change the hash
+    memset(&key, 0, sizeof(key));
+    memcpy(key.create_id, in->create_id, sizeof(key.create_id));
+    key.content_hash = hash64(in, sizeof(ver3StoreData));
+    key.key_hash = hash64(&qr_key, sizeof(qr_key));
+
+    MiiQrImageCache& cache = getMiiQrImageCache();
+    if(cache.find(key, out)) {
+        return 0;
+    }
+    ret = generateMiiQr(in, out);
     if(R_SUCCEEDED(ret)) {
-        out = generateQrRGBA((u8*)&data, sizeof(miiQrData), scale, out_width);
+        cache.store(key, *out);
     }
     return ret;
 }
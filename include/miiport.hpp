@@ -2,6 +2,13 @@
 #include <string>
 #include <cstring>
 #include <filesystem>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 namespace fs = std::filesystem;
 
 #include <switch.h>
@@ -70,6 +77,10 @@ void errorNotify(Result res, std::string success_message = "Imported!") {
             brls::Application::notify("qrkey.txt not found.\nSee \"About\" tab.");
             break;
         }
+        case FILE_READ_FAIL: {
+            brls::Application::notify("Could not read file");
+            break;
+        }
         default: {
             errorCodeNotify(res);
             break;
@@ -144,6 +155,22 @@ Result addOrReplaceStoreData(const storeData *input) {
     return res;
 }
 
+// Adds all of them in one database session. Returns the first failure.
+Result addOrReplaceStoreData(const storeData *inputs, size_t count, Result *out_results = nullptr) {
+    MiiDatabase DbService;
+    Result res;
+    res = miiOpenDatabase(&DbService, MiiSpecialKeyCode_Special);
+    if(R_FAILED(res)) return res;
+    Result first_fail = 0;
+    for(size_t i = 0; i < count; i++) {
+        res = miiDatabaseAddOrReplace(&DbService, &inputs[i]);
+        if(out_results) out_results[i] = res;
+        if(R_FAILED(res) && R_SUCCEEDED(first_fail)) first_fail = res;
+    }
+    miiDatabaseClose(&DbService);
+    return first_fail;
+}
+
 void showDupeCreateIDPopup(storeData *input){
     brls::Dialog* dialog = new brls::Dialog("A Mii with the same Mii ID already exists on your switch.");
 
@@ -154,9 +181,10 @@ void showDupeCreateIDPopup(storeData *input){
         dialog->close();
     };
     brls::GenericEvent::Callback randomCallback = [dialog, input{*input}](brls::View* view) mutable {
-        makeRandCreateId(&input.create_id);
-        // changed data, so re-generate storedata hashes
-        setStoreDataCrc16(&input);
+        MiiCreateId id;
+        makeRandCreateId(&id);
+        // only the create ID changed, so patch the storedata hashes
+        updateStoreDataCrcForCreateId(&input, &id);
         Result res = addOrReplaceStoreData(&input);
 
         errorNotify(res);
@@ -282,12 +310,14 @@ Result miiDbAddOrReplaceCharInfoFromFile(const char* file_path) {
 }
 
 Result showQrPopup(ver3StoreData* data, std::string name) {
-    int qr_width = 0;
-    std::unique_ptr<u32[]> qr_RGBA;
-    Result res = generateMiiQr(data, 8, &qr_width, qr_RGBA);
+    miiQrSymbol symbol;
+    Result res = generateMiiQrCached(data, &symbol);
     if(R_FAILED(res)) {
         return res;
     }
+    // borealis copies the pixels into a texture straight away, so they're only kept until then
+    int qr_width = 0;
+    std::unique_ptr<u32[]> qr_RGBA = drawQrRGBA(symbol, 8, &qr_width);
     brls::Image *qr_image = new brls::Image;
     qr_image->setScaleType(brls::ImageScaleType::NO_RESIZE);
     qr_image->setImageRGBA((u8*)qr_RGBA.get(), qr_width, qr_width);
@@ -297,16 +327,28 @@ Result showQrPopup(ver3StoreData* data, std::string name) {
     return 0;
 }
 
+// Imports every Mii QR in the image
 Result importMiiQr(const char* path) {
-    ver3StoreData ver3mii;
-    storeData mii;
+    std::vector<miiQrDecodeResult> results;
+    std::vector<storeData> miis;
     Result res;
-    res = parseMiiQr(path, &ver3mii);
+    res = parseAllMiiQrs(path, results);
     if(R_FAILED(res)) {
         return res;
     }
-    ver3StoreDataToStoreData(&ver3mii, &mii);
-    return addOrReplaceStoreData(&mii);
+    for(const miiQrDecodeResult& result : results) {
+        if(R_SUCCEEDED(result.res)) {
+            miis.emplace_back();
+            ver3StoreDataToStoreData(&result.mii, &miis.back());
+        }
+    }
+    return addOrReplaceStoreData(miis.data(), miis.size());
+}
+
+bool isJpegPath(const fs::path& path) {
+    std::string ext = path.extension().string();
+    stringToLower(&ext);
+    return ext == ".jpg" || ext == ".jpeg";
 }
 
 Result importMiiFile(fs::path file_path) {
@@ -326,7 +368,7 @@ Result importMiiFile(fs::path file_path) {
     else if(ext == ".storedata") {
         res = miiDbAddOrReplaceStoreDataFromFile(file_path.c_str());
     }
-    else if(ext == ".jpg" || ext == ".jpeg") {
+    else if(isJpegPath(file_path)) {
         res = importMiiQr(file_path.c_str());
     }
     else {
@@ -334,3 +376,185 @@ Result importMiiFile(fs::path file_path) {
     }
     return res;
 }
+
+// Number of cores this process may run on
+unsigned int getWorkerThreadCount() {
+#if defined(__SWITCH__)
+    u64 core_mask = 0;
+    if(R_SUCCEEDED(svcGetInfo(&core_mask, InfoType_CoreMask, CUR_PROCESS_HANDLE, 0)) && core_mask != 0) {
+        return __builtin_popcountll(core_mask);
+    }
+    return 1;
+#else
+    unsigned int count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+#endif
+}
+
+// libnx starts every thread on the default core, so workers move themselves to one core each
+void pinWorkerThread(unsigned int index) {
+#if defined(__SWITCH__)
+    u64 core_mask = 0;
+    if(R_FAILED(svcGetInfo(&core_mask, InfoType_CoreMask, CUR_PROCESS_HANDLE, 0)) || core_mask == 0) {
+        return;
+    }
+    index %= __builtin_popcountll(core_mask);
+    for(int core = 0; core < 64; core++) {
+        if(core_mask & (1ULL << core)) {
+            if(index-- == 0) {
+                svcSetThreadCoreMask(CUR_THREAD_HANDLE, core, 1ULL << core);
+                return;
+            }
+        }
+    }
+#endif
+}
+
+typedef struct {
+    fs::path path;
+    Result res;
+    int found;
+    int imported;
+    // decode tier that found the QRs, -1 if none
+    int tier;
+} miiQrImportFileResult;
+
+typedef struct {
+    std::vector<miiQrImportFileResult> files;
+    int imported;
+    double seconds;
+    double images_per_sec;
+} miiQrImportReport;
+
+/*
+ * Imports every Mii QR in the given images.
+ * Files are read, decoded and decrypted on a pool of worker threads, one per core by default.
+ * Database writes all go through a single committer thread with one database session.
+ * Images without finder patterns are skipped by the pre-filter unless prefilter is QR_PREFILTER_OFF.
+ * Returns the first failure, per file results and throughput are written to report.
+ * If files_done is given, it counts the images that have been decoded so far.
+ */
+Result importMiiQrs(const std::vector<fs::path>& paths, miiQrImportReport* report, unsigned int thread_count = 0, qrPrefilterMode prefilter = QR_PREFILTER_ON, std::atomic<size_t>* files_done = nullptr) {
+    typedef struct {
+        size_t file;
+        std::vector<storeData> miis;
+    } pendingImport;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<pendingImport> queue;
+    std::atomic<size_t> next_file(0);
+    size_t workers_left;
+
+    report->files.resize(paths.size());
+    report->imported = 0;
+    for(size_t i = 0; i < paths.size(); i++) {
+        report->files[i] = {paths[i], 0, 0, 0, -1};
+    }
+    if(thread_count == 0) {
+        thread_count = getWorkerThreadCount();
+    }
+    workers_left = thread_count;
+    // initialize on this thread, it isn't safe to do from the workers
+    const StoreDataCrcContext& crc_ctx = getStoreDataCrcContext();
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&](unsigned int index) {
+        pinWorkerThread(index);
+        MiiQrDecoderLease decoder;
+        decoder->setPrefilter(prefilter);
+        std::vector<miiQrDecodeResult> results;
+        for(size_t i = next_file++; i < paths.size(); i = next_file++) {
+            miiQrImportFileResult& file = report->files[i];
+            file.res = decodeAllMiiQrsCached(decoder.get(), paths[i].c_str(), results, &file.tier);
+            file.found = results.size();
+            if(files_done) {
+                (*files_done)++;
+            }
+            if(R_FAILED(file.res)) {
+                continue;
+            }
+            pendingImport pending = {i, {}};
+            for(const miiQrDecodeResult& result : results) {
+                if(R_SUCCEEDED(result.res)) {
+                    pending.miis.emplace_back();
+                    ver3StoreDataToStoreData(&result.mii, &pending.miis.back(), crc_ctx);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                queue.push_back(std::move(pending));
+            }
+            queue_cv.notify_one();
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            workers_left--;
+        }
+        queue_cv.notify_one();
+    };
+
+    auto committer = [&]() {
+        MiiDatabase DbService;
+        Result db_res = miiOpenDatabase(&DbService, MiiSpecialKeyCode_Special);
+        while(true) {
+            pendingImport pending;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [&] { return !queue.empty() || workers_left == 0; });
+                if(queue.empty()) {
+                    break;
+                }
+                pending = std::move(queue.front());
+                queue.pop_front();
+            }
+            miiQrImportFileResult& file = report->files[pending.file];
+            if(R_FAILED(db_res)) {
+                file.res = db_res;
+                continue;
+            }
+            for(const storeData& mii : pending.miis) {
+                Result res = miiDatabaseAddOrReplace(&DbService, &mii);
+                if(R_FAILED(res)) {
+                    if(R_SUCCEEDED(file.res)) file.res = res;
+                }
+                else {
+                    file.imported++;
+                }
+            }
+        }
+        if(R_SUCCEEDED(db_res)) {
+            miiDatabaseClose(&DbService);
+        }
+    };
+
+    std::thread committer_thread(committer);
+    std::vector<std::thread> worker_threads;
+    for(unsigned int i = 0; i < thread_count; i++) {
+        worker_threads.emplace_back(worker, i);
+    }
+    for(std::thread& thread : worker_threads) {
+        thread.join();
+    }
+    committer_thread.join();
+    getMiiQrDecodeCache().flush();
+
+    report->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report->images_per_sec = report->seconds > 0 ? paths.size() / report->seconds : 0;
+    Result first_fail = 0;
+    for(const miiQrImportFileResult& file : report->files) {
+        report->imported += file.imported;
+        if(R_FAILED(file.res) && R_SUCCEEDED(first_fail)) {
+            first_fail = file.res;
+        }
+    }
+    return first_fail;
+}
+
+void printMiiQrImportReport(const miiQrImportReport& report) {
+    for(const miiQrImportFileResult& file : report.files) {
+        printf("%s: 0x%x, %d of %d imported, tier %d\n", file.path.c_str(), file.res, file.imported, file.found, file.tier);
+    }
+    printf("Imported %d Miis from %zu images in %.2fs (%.1f images/s)\n", report.imported, report.files.size(), report.seconds, report.images_per_sec);
+    printQrDecodeStats();
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <switch/types.h>
+#include "bit_row.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/*
+ * Cheap check for QR finder patterns in a small greyscale image, used to skip
+ * images that clearly have no QR before running the full decode.
+ * Rows are thresholded 8 pixels at a time into one bit per pixel, and runs are
+ * found with count-trailing-zeros on the packed rows.
+ * A 1:1:3:1:1 dark/light run along a row that also holds up vertically through its
+ * centre counts as a finder. It is deliberately lenient, as a false negative loses a QR.
+ */
+
+// images with fewer finder candidates than this are rejected
+const int QR_PREFILTER_MIN_FINDERS = 2;
+// smallest finder width in pixels that is checked
+const int QR_PREFILTER_MIN_FINDER_SIZE = 7;
+// only pixels this far below the mean count as dark, so flat noisy areas don't make runs
+const int QR_PREFILTER_DARK_MARGIN = 24;
+
+/*
+ * Sets bit i of the result for each of the 8 pixels with (pixel >> 1) <= limit7.
+ * Both sides are halved so the per byte subtraction can't borrow.
+ */
+u8 qrDarkMask8(u64 pixels, u64 limit7) {
+    const u64 ones = 0x0101010101010101ULL;
+    const u64 high = 0x8080808080808080ULL;
+    u64 halved = (pixels >> 1) & 0x7F7F7F7F7F7F7F7FULL;
+    u64 dark = (((limit7 * ones) | high) - halved) & high;
+    return ((dark >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+// 1 bit per pixel, set for dark pixels, rows padded to whole words
+class QrBitImage {
+    private:
+        std::vector<u64> words;
+
+    public:
+        int width = 0;
+        int height = 0;
+        int words_per_row = 0;
+
+        // pixels darker than level are set
+        void threshold(const u8* image, int w, int h, int pitch, u8 level) {
+            width = w;
+            height = h;
+            words_per_row = (w + 63) / 64;
+            words.assign((size_t)words_per_row * h, 0);
+            if(level < 2) {
+                return;
+            }
+            u64 limit7 = (level >> 1) - 1;
+            for(int y = 0; y < h; y++) {
+                const u8* row = image + (size_t)y * pitch;
+                u8* out = (u8*)&words[(size_t)y * words_per_row];
+                int x = 0;
+                for(; x + 8 <= w; x += 8) {
+                    u64 pixels;
+                    memcpy(&pixels, row + x, sizeof(pixels));
+                    out[x / 8] = qrDarkMask8(pixels, limit7);
+                }
+                for(; x < w; x++) {
+                    if((row[x] >> 1) <= limit7) {
+                        out[x / 8] |= 1 << (x % 8);
+                    }
+                }
+            }
+        }
+
+        bool dark(int x, int y) const {
+            return (words[(size_t)y * words_per_row + x / 64] >> (x % 64)) & 1;
+        }
+
+        // first x >= from whose colour differs from the pixel at from, or width
+        int nextEdge(int y, int from) const {
+            return bitRowNextEdge(&words[(size_t)y * words_per_row], words_per_row, width, from);
+        }
+};
+
+// runs are dark, light, dark, light, dark
+bool qrFinderRatio(const int runs[5]) {
+    int total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+    if(total < QR_PREFILTER_MIN_FINDER_SIZE) {
+        return false;
+    }
+    // everything in sevenths of a pixel, each run may be off by half a module plus a pixel
+    int module7 = total;
+    for(int i = 0; i < 5; i++) {
+        int modules = i == 2 ? 3 : 1;
+        if(abs(runs[i] * 7 - modules * module7) >= modules * module7 / 2 + 7) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// checks the column through (x, y), which is in the dark centre of a candidate size pixels wide
+bool qrFinderVertical(const QrBitImage& bits, int x, int y, int size) {
+    int runs[5] = {};
+    int up = y;
+    while(up >= 0 && bits.dark(x, up) && runs[2] <= size) { runs[2]++; up--; }
+    while(up >= 0 && !bits.dark(x, up) && runs[1] <= size) { runs[1]++; up--; }
+    while(up >= 0 && bits.dark(x, up) && runs[0] <= size) { runs[0]++; up--; }
+    int down = y + 1;
+    while(down < bits.height && bits.dark(x, down) && runs[2] <= size) { runs[2]++; down++; }
+    while(down < bits.height && !bits.dark(x, down) && runs[3] <= size) { runs[3]++; down++; }
+    while(down < bits.height && bits.dark(x, down) && runs[4] <= size) { runs[4]++; down++; }
+    // finders are square, so the column should be about as tall as the row was wide
+    int total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+    if(abs(total - size) > size / 2 + 1) {
+        return false;
+    }
+    return qrFinderRatio(runs);
+}
+
+typedef struct {
+    int x, y, size;
+} qrFinderCandidate;
+
+// Counts distinct finder pattern candidates, stopping once enough is found
+int qrCountFinders(const u8* image, int w, int h, int pitch, int enough = QR_PREFILTER_MIN_FINDERS) {
+    if(w < 7 || h < 7) {
+        return 0;
+    }
+    u64 sum = 0;
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x++) {
+            sum += image[(size_t)y * pitch + x];
+        }
+    }
+    int mean = sum / ((u64)w * h);
+    if(mean <= QR_PREFILTER_DARK_MARGIN) {
+        return 0;
+    }
+    QrBitImage bits;
+    bits.threshold(image, w, h, pitch, mean - QR_PREFILTER_DARK_MARGIN);
+
+    std::vector<qrFinderCandidate> finders;
+    for(int y = 0; y < h; y++) {
+        // the last five runs, oldest first
+        int runs[5] = {};
+        int run_count = 0;
+        int x = 0;
+        while(x < w) {
+            int end = bits.nextEdge(y, x);
+            bool run_dark = bits.dark(x, y);
+            if(run_count == 0 && !run_dark) {
+                x = end;
+                continue;
+            }
+            memmove(runs, runs + 1, sizeof(int) * 4);
+            runs[4] = end - x;
+            run_count++;
+            if(run_dark && run_count >= 5 && qrFinderRatio(runs)) {
+                int size = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+                int cx = x - runs[3] - runs[2] + runs[2] / 2;
+                if(qrFinderVertical(bits, cx, y, size)) {
+                    bool known = false;
+                    for(const qrFinderCandidate& f : finders) {
+                        if(abs(f.x - cx) <= size / 2 + 1 && abs(f.y - y) <= size) {
+                            known = true;
+                            break;
+                        }
+                    }
+                    if(!known) {
+                        finders.push_back({cx, y, size});
+                        if((int)finders.size() >= enough) {
+                            return finders.size();
+                        }
+                    }
+                }
+            }
+            x = end;
+        }
+    }
+    return finders.size();
+}
+
+bool qrPrefilterPasses(const u8* image, int w, int h, int pitch) {
+    return qrCountFinders(image, w, h, pitch) >= QR_PREFILTER_MIN_FINDERS;
+}
@@ -0,0 +1,416 @@
+#pragma once
+#include "turbojpeg.h"
+#include <switch/types.h>
+#include "errors.h"
+#include "file_input.h"
+#include "hash64.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <sys/stat.h>
+
+// longest side of a list thumbnail
+const int THUMBNAIL_SIZE = 96;
+
+typedef struct {
+    size_t id;
+    int width;
+    int height;
+    std::vector<u8> rgba;
+} thumbnailImage;
+
+// Box filters src down to out_w by out_h. Both are RGBA.
+void shrinkRGBA(const u8* src, int src_w, int src_h, u8* out, int out_w, int out_h) {
+    for(int oy = 0; oy < out_h; oy++) {
+        int y0 = oy * src_h / out_h;
+        int y1 = (oy + 1) * src_h / out_h;
+        if(y1 <= y0) y1 = y0 + 1;
+        for(int ox = 0; ox < out_w; ox++) {
+            int x0 = ox * src_w / out_w;
+            int x1 = (ox + 1) * src_w / out_w;
+            if(x1 <= x0) x1 = x0 + 1;
+            u32 sum[4] = {};
+            for(int y = y0; y < y1; y++) {
+                const u8* p = src + ((size_t)y * src_w + x0) * 4;
+                for(int x = x0; x < x1; x++, p += 4) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    sum[3] += p[3];
+                }
+            }
+            u32 count = (y1 - y0) * (x1 - x0);
+            u8* o = out + ((size_t)oy * out_w + ox) * 4;
+            for(int c = 0; c < 4; c++) {
+                o[c] = sum[c] / count;
+            }
+        }
+    }
+}
+
+/*
+ * Decodes a jpeg to an RGBA thumbnail no larger than max_side.
+ * turbojpeg scales while decoding to the smallest size that still covers max_side,
+ * so the full image is never decoded. The rest is done with a box filter.
+ */
+Result decodeThumbnail(tjhandle handle, const u8* jpg_data, size_t jpg_size, int max_side, thumbnailImage* out) {
+    int w, h, subsamp, colorspace;
+    if(tjDecompressHeader3(handle, jpg_data, jpg_size, &w, &h, &subsamp, &colorspace) != 0 || w <= 0 || h <= 0) {
+        return JPEG_DECODE_FAIL;
+    }
+    int long_side = w > h ? w : h;
+
+    int factor_count = 0;
+    tjscalingfactor* factors = tjGetScalingFactors(&factor_count);
+    tjscalingfactor scale = {1, 1};
+    for(int i = 0; i < factor_count; i++) {
+        int scaled = TJSCALED(long_side, factors[i]);
+        if(scaled >= max_side && scaled < TJSCALED(long_side, scale)) {
+            scale = factors[i];
+        }
+    }
+    int scaled_w = TJSCALED(w, scale);
+    int scaled_h = TJSCALED(h, scale);
+    std::vector<u8> scaled((size_t)scaled_w * scaled_h * 4);
+    if(tjDecompress2(handle, jpg_data, jpg_size, scaled.data(), scaled_w, 0, scaled_h, TJPF_RGBA, TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE) != 0) {
+        return JPEG_DECODE_FAIL;
+    }
+
+    if(scaled_w <= max_side && scaled_h <= max_side) {
+        out->width = scaled_w;
+        out->height = scaled_h;
+        out->rgba = std::move(scaled);
+        return 0;
+    }
+    int scaled_long = scaled_w > scaled_h ? scaled_w : scaled_h;
+    out->width = scaled_w * max_side / scaled_long;
+    out->height = scaled_h * max_side / scaled_long;
+    if(out->width < 1) out->width = 1;
+    if(out->height < 1) out->height = 1;
+    out->rgba.resize((size_t)out->width * out->height * 4);
+    shrinkRGBA(scaled.data(), scaled_w, scaled_h, out->rgba.data(), out->width, out->height);
+    return 0;
+}
+
+const char* THUMBNAIL_CACHE_PATH = "/MiiPort/thumbcache.bin";
+const u32 THUMBNAIL_CACHE_MAGIC = 0x4354504d; // "MPTC"
+const u32 THUMBNAIL_CACHE_VERSION = 1;
+// thumbnails whose channels are all within this of each other are stored as greyscale
+const int THUMBNAIL_GREY_TOLERANCE = 6;
+
+typedef struct {
+    u64 path_hash;
+    u64 size;
+    s64 mtime;
+} thumbnailKey;
+
+thumbnailKey makeThumbnailKey(const std::string& path) {
+    thumbnailKey key = {hash64(path.data(), path.size()), 0, 0};
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0) {
+        key.size = st.st_size;
+        key.mtime = st.st_mtime;
+    }
+    return key;
+}
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 count;
+    u32 thumbnail_size;
+} thumbnailCacheHeader;
+
+// index entry, the pixels are at offset from the start of the pixel data
+typedef struct {
+    thumbnailKey key;
+    u32 offset;
+    u16 width;
+    u16 height;
+    u8 channels;
+    u8 padding[7];
+} thumbnailCacheEntry;
+
+/*
+ * Packed file of pre-scaled thumbnails: a header, an index and then the pixels, RGBA or greyscale.
+ * It is read in one go when loaded, and rewritten by save() with only the thumbnails
+ * that were used or kept this session, so images that were removed drop out.
+ * Lookups and adds come from the loader thread, so everything else takes the mutex too.
+ */
+class ThumbnailCache {
+    private:
+        typedef struct {
+            thumbnailKey key;
+            u16 width;
+            u16 height;
+            u8 channels;
+            std::vector<u8> pixels;
+            bool used;
+        } cachedThumbnail;
+
+        std::string path;
+        std::mutex mutex;
+        std::vector<cachedThumbnail> thumbnails;
+        std::unordered_map<u64, size_t> by_path;
+        bool dirty = false;
+
+        static bool isGrey(const thumbnailImage& image) {
+            for(size_t i = 0; i < image.rgba.size(); i += 4) {
+                const u8* p = &image.rgba[i];
+                if(abs(p[0] - p[1]) > THUMBNAIL_GREY_TOLERANCE || abs(p[1] - p[2]) > THUMBNAIL_GREY_TOLERANCE || p[3] != 0xFF) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    public:
+        ThumbnailCache(const char* cache_path) : path(cache_path) {}
+
+        void load() {
+            std::lock_guard<std::mutex> lock(mutex);
+            thumbnails.clear();
+            by_path.clear();
+            FILE* file = fopen(path.c_str(), "rb");
+            if(!file) {
+                return;
+            }
+            std::vector<u8> data;
+            struct stat st;
+            if(fstat(fileno(file), &st) == 0 && st.st_size > 0) {
+                data.resize(st.st_size);
+                if(fread(data.data(), 1, data.size(), file) != data.size()) {
+                    data.clear();
+                }
+            }
+            fclose(file);
+
+            thumbnailCacheHeader header;
+            if(data.size() < sizeof(header)) {
+                return;
+            }
+            memcpy(&header, data.data(), sizeof(header));
+            if(header.magic != THUMBNAIL_CACHE_MAGIC || header.version != THUMBNAIL_CACHE_VERSION || header.thumbnail_size != THUMBNAIL_SIZE) {
+                return;
+            }
+            size_t pixels_start = sizeof(header) + (size_t)header.count * sizeof(thumbnailCacheEntry);
+            if(pixels_start > data.size()) {
+                return;
+            }
+            for(u32 i = 0; i < header.count; i++) {
+                thumbnailCacheEntry entry;
+                memcpy(&entry, data.data() + sizeof(header) + i * sizeof(entry), sizeof(entry));
+                size_t length = (size_t)entry.width * entry.height * entry.channels;
+                size_t start = pixels_start + entry.offset;
+                if((entry.channels != 1 && entry.channels != 4) || start + length > data.size()) {
+                    continue;
+                }
+                thumbnails.push_back({entry.key, entry.width, entry.height, entry.channels,
+                    std::vector<u8>(data.begin() + start, data.begin() + start + length), false});
+                by_path[entry.key.path_hash] = thumbnails.size() - 1;
+            }
+        }
+
+        /*
+         * Marks the thumbnail for this path as still wanted, so save() keeps it.
+         * The file isn't stat'ed here, find() checks the version when the thumbnail is shown.
+         */
+        void keep(u64 path_hash) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = by_path.find(path_hash);
+            if(it != by_path.end()) {
+                thumbnails[it->second].used = true;
+            }
+        }
+
+        // Fills out with the cached RGBA thumbnail if there is one for this version of the file
+        bool find(const thumbnailKey& key, thumbnailImage* out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = by_path.find(key.path_hash);
+            if(it == by_path.end()) {
+                return false;
+            }
+            cachedThumbnail& cached = thumbnails[it->second];
+            if(cached.key.size != key.size || cached.key.mtime != key.mtime) {
+                return false;
+            }
+            cached.used = true;
+            out->width = cached.width;
+            out->height = cached.height;
+            if(cached.channels == 4) {
+                out->rgba = cached.pixels;
+                return true;
+            }
+            out->rgba.resize(cached.pixels.size() * 4);
+            for(size_t i = 0; i < cached.pixels.size(); i++) {
+                u8* p = &out->rgba[i * 4];
+                p[0] = p[1] = p[2] = cached.pixels[i];
+                p[3] = 0xFF;
+            }
+            return true;
+        }
+
+        void add(const thumbnailKey& key, const thumbnailImage& image) {
+            cachedThumbnail cached = {key, (u16)image.width, (u16)image.height, 4, {}, true};
+            if(isGrey(image)) {
+                cached.channels = 1;
+                cached.pixels.resize(image.rgba.size() / 4);
+                for(size_t i = 0; i < cached.pixels.size(); i++) {
+                    cached.pixels[i] = image.rgba[i * 4 + 1];
+                }
+            }
+            else {
+                cached.pixels = image.rgba;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = by_path.find(key.path_hash);
+            if(it != by_path.end()) {
+                thumbnails[it->second] = std::move(cached);
+            }
+            else {
+                thumbnails.push_back(std::move(cached));
+                by_path[key.path_hash] = thumbnails.size() - 1;
+            }
+            dirty = true;
+        }
+
+        // Writes the cache if anything was added, keeping only thumbnails used or kept this session
+        void save() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!dirty) {
+                return;
+            }
+            std::vector<const cachedThumbnail*> keep;
+            for(const cachedThumbnail& cached : thumbnails) {
+                if(cached.used) {
+                    keep.push_back(&cached);
+                }
+            }
+            std::vector<thumbnailCacheEntry> index(keep.size());
+            u32 offset = 0;
+            for(size_t i = 0; i < keep.size(); i++) {
+                index[i] = {keep[i]->key, offset, keep[i]->width, keep[i]->height, keep[i]->channels, {}};
+                offset += keep[i]->pixels.size();
+            }
+            FILE* file = fopen(path.c_str(), "wb");
+            if(!file) {
+                printf("thumbnail cache open error: %d\n", errno);
+                return;
+            }
+            thumbnailCacheHeader header = {THUMBNAIL_CACHE_MAGIC, THUMBNAIL_CACHE_VERSION, (u32)keep.size(), THUMBNAIL_SIZE};
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(index.data(), sizeof(thumbnailCacheEntry), index.size(), file) == index.size();
+            for(const cachedThumbnail* cached : keep) {
+                ok = ok && fwrite(cached->pixels.data(), 1, cached->pixels.size(), file) == cached->pixels.size();
+            }
+            fclose(file);
+            if(!ok) {
+                printf("thumbnail cache write error\n");
+                remove(path.c_str());
+                return;
+            }
+            dirty = false;
+        }
+};
+
+/*
+ * Makes thumbnails on a background thread.
+ * Requests are served newest first, so the rows that just scrolled into view come before
+ * ones that were passed over. Each file is stat'ed here to look it up in the cache,
+ * and only decoded on a miss, so the UI thread never touches the SD card for thumbnails.
+ * Finished thumbnails are collected with takeReady,
+ * which the UI thread calls since textures can only be created there.
+ */
+class ThumbnailLoader {
+    private:
+        typedef struct {
+            size_t id;
+            std::string path;
+        } thumbnailRequest;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<thumbnailRequest> requests;
+        std::vector<thumbnailImage> ready;
+        bool stopping = false;
+        ThumbnailCache& cache;
+        std::thread worker;
+
+        void run() {
+            tjhandle handle = tjInitDecompress();
+            if(handle == nullptr) {
+                printf("tjInitDecompress failed\n");
+                return;
+            }
+            while(true) {
+                thumbnailRequest request;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [this] { return stopping || !requests.empty(); });
+                    if(stopping) {
+                        break;
+                    }
+                    request = std::move(requests.back());
+                    requests.pop_back();
+                }
+                thumbnailImage thumbnail;
+                thumbnail.id = request.id;
+                thumbnailKey key = makeThumbnailKey(request.path);
+                if(!cache.find(key, &thumbnail)) {
+                    FileInput jpg;
+                    Result res = jpg.open(request.path.c_str());
+                    if(R_SUCCEEDED(res)) {
+                        res = decodeThumbnail(handle, jpg.getData(), jpg.getSize(), THUMBNAIL_SIZE, &thumbnail);
+                    }
+                    if(R_FAILED(res)) {
+                        printf("thumbnail failed for %s: 0x%x\n", request.path.c_str(), res);
+                        continue;
+                    }
+                    cache.add(key, thumbnail);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                ready.push_back(std::move(thumbnail));
+            }
+            tjDestroy(handle);
+        }
+
+    public:
+        ThumbnailLoader(ThumbnailCache& thumbnail_cache) : cache(thumbnail_cache), worker(&ThumbnailLoader::run, this) {}
+        ThumbnailLoader(const ThumbnailLoader&) = delete;
+        ThumbnailLoader& operator=(const ThumbnailLoader&) = delete;
+        ~ThumbnailLoader() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_one();
+            worker.join();
+        }
+
+        // The caller makes sure each id is only requested once
+        void request(size_t id, const std::string& path) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                requests.push_back({id, path});
+            }
+            cv.notify_one();
+        }
+
+        // Moves finished thumbnails into out. Returns false if there were none.
+        bool takeReady(std::vector<thumbnailImage>& out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(ready.empty()) {
+                return false;
+            }
+            out.swap(ready);
+            ready.clear();
+            return true;
+        }
+};
@@ -229,7 +229,7 @@ const char *QrSegment::ALPHANUMERIC_CHARSET = "0123456789ABCDEFGHIJKLMNOPQRSTUVW
 
 
 
-int QrCode::getFormatBits(Ecc ecl) {
+constexpr int QrCode::getFormatBits(Ecc ecl) {
 	switch (ecl) {
 		case Ecc::LOW     :  return 1;
 		case Ecc::MEDIUM  :  return 0;
@@ -326,9 +326,10 @@ QrCode::QrCode(int ver, Ecc ecl, const vector<uint8_t> &dataCodewords, int msk)
 	if (msk < -1 || msk > 7)
 		throw std::domain_error("Mask value out of range");
 	size = ver * 4 + 17;
-	size_t sz = static_cast<size_t>(size);
-	modules    = vector<vector<bool> >(sz, vector<bool>(sz));  // Initially all white
-	isFunction = vector<vector<bool> >(sz, vector<bool>(sz));
+	wordsPerRow = (size + 63) / 64;
+	size_t words = static_cast<size_t>(size) * static_cast<size_t>(wordsPerRow);
+	modules    = vector<uint64_t>(words);  // Initially all white
+	isFunction = vector<uint64_t>(words);
 	
 	// Compute ECC, draw modules
 	drawFunctionPatterns();
@@ -385,6 +386,18 @@ bool QrCode::getModule(int x, int y) const {
 }
 
 
+const uint64_t *QrCode::getRow(int y) const {
+	if (y < 0 || y >= size)
+		throw std::out_of_range("Row out of range");
+	return &modules[static_cast<size_t>(y) * static_cast<size_t>(wordsPerRow)];
+}
+
+
+int QrCode::getWordsPerRow() const {
+	return wordsPerRow;
+}
+
+
 std::string QrCode::toSvgString(int border) const {
 	if (border < 0)
 		throw std::domain_error("Border must be non-negative");
@@ -514,15 +527,32 @@ void QrCode::drawAlignmentPattern(int x, int y) {
 
 
 void QrCode::setFunctionModule(int x, int y, bool isBlack) {
-	size_t ux = static_cast<size_t>(x);
-	size_t uy = static_cast<size_t>(y);
-	modules   .at(uy).at(ux) = isBlack;
-	isFunction.at(uy).at(ux) = true;
+	if (x < 0 || x >= size || y < 0 || y >= size)
+		throw std::out_of_range("Module out of range");
+	size_t row = static_cast<size_t>(y) * static_cast<size_t>(wordsPerRow);
+	setBit(&modules   [row], x, isBlack);
+	setBit(&isFunction[row], x, true);
 }
 
 
 bool QrCode::module(int x, int y) const {
-	return modules.at(static_cast<size_t>(y)).at(static_cast<size_t>(x));
+	if (x < 0 || x >= size || y < 0 || y >= size)
+		throw std::out_of_range("Module out of range");
+	return testBit(&modules[static_cast<size_t>(y) * static_cast<size_t>(wordsPerRow)], x);
+}
+
+
+void QrCode::setBit(uint64_t *row, int x, bool value) {
+	uint64_t bit = uint64_t(1) << (x & 63);
+	if (value)
+		row[x >> 6] |= bit;
+	else
+		row[x >> 6] &= ~bit;
+}
+
+
+bool QrCode::testBit(const uint64_t *row, int x) {
+	return ((row[x >> 6] >> (x & 63)) & 1) != 0;
 }
 
 
@@ -539,7 +569,7 @@ vector<uint8_t> QrCode::addEccAndInterleave(const vector<uint8_t> &data) const {
 	
 	// Split data into blocks and append ECC to each block
 	vector<vector<uint8_t> > blocks;
-	const vector<uint8_t> rsDiv = reedSolomonComputeDivisor(blockEccLen);
+	const vector<uint8_t> &rsDiv = reedSolomonGetDivisor(blockEccLen);
 	for (int i = 0, k = 0; i < numBlocks; i++) {
 		vector<uint8_t> dat(data.cbegin() + k, data.cbegin() + (k + shortBlockLen - blockEccLen + (i < numShortBlocks ? 0 : 1)));
 		k += static_cast<int>(dat.size());
@@ -576,11 +606,12 @@ void QrCode::drawCodewords(const vector<uint8_t> &data) {
 			right = 5;
 		for (int vert = 0; vert < size; vert++) {  // Vertical counter
 			for (int j = 0; j < 2; j++) {
-				size_t x = static_cast<size_t>(right - j);  // Actual x coordinate
+				int x = right - j;  // Actual x coordinate
 				bool upward = ((right + 1) & 2) == 0;
-				size_t y = static_cast<size_t>(upward ? size - 1 - vert : vert);  // Actual y coordinate
-				if (!isFunction.at(y).at(x) && i < data.size() * 8) {
-					modules.at(y).at(x) = getBit(data.at(i >> 3), 7 - static_cast<int>(i & 7));
+				int y = upward ? size - 1 - vert : vert;  // Actual y coordinate
+				size_t row = static_cast<size_t>(y) * static_cast<size_t>(wordsPerRow);
+				if (!testBit(&isFunction[row], x) && i < data.size() * 8) {
+					setBit(&modules[row], x, getBit(data.at(i >> 3), 7 - static_cast<int>(i & 7)));
 					i++;
 				}
 				// If this QR Code has any remainder bits (0 to 7), they were assigned as
@@ -596,94 +627,79 @@ void QrCode::drawCodewords(const vector<uint8_t> &data) {
 void QrCode::applyMask(int msk) {
 	if (msk < 0 || msk > 7)
 		throw std::domain_error("Mask value out of range");
-	size_t sz = static_cast<size_t>(size);
-	for (size_t y = 0; y < sz; y++) {
-		for (size_t x = 0; x < sz; x++) {
-			bool invert;
-			switch (msk) {
-				case 0:  invert = (x + y) % 2 == 0;                    break;
-				case 1:  invert = y % 2 == 0;                          break;
-				case 2:  invert = x % 3 == 0;                          break;
-				case 3:  invert = (x + y) % 3 == 0;                    break;
-				case 4:  invert = (x / 3 + y / 2) % 2 == 0;            break;
-				case 5:  invert = x * y % 2 + x * y % 3 == 0;          break;
-				case 6:  invert = (x * y % 2 + x * y % 3) % 2 == 0;    break;
-				case 7:  invert = ((x + y) % 2 + x * y % 3) % 2 == 0;  break;
-				default:  throw std::logic_error("Assertion error");
-			}
-			modules.at(y).at(x) = modules.at(y).at(x) ^ (invert & !isFunction.at(y).at(x));
+	// The pattern repeats every MASK_PERIOD rows, so only that many distinct packed rows are needed
+	size_t rowWords = static_cast<size_t>(wordsPerRow);
+	vector<uint64_t> pattern(static_cast<size_t>(MASK_PERIOD) * rowWords);
+	for (int y = 0; y < MASK_PERIOD; y++) {
+		for (int x = 0; x < size; x++) {
+			if (maskInverts(msk, x, y))
+				setBit(&pattern[static_cast<size_t>(y) * rowWords], x, true);
 		}
 	}
+	for (int y = 0; y < size; y++) {
+		uint64_t *row = &modules[static_cast<size_t>(y) * rowWords];
+		const uint64_t *func = &isFunction[static_cast<size_t>(y) * rowWords];
+		const uint64_t *invert = &pattern[static_cast<size_t>(y % MASK_PERIOD) * rowWords];
+		for (size_t i = 0; i < rowWords; i++)
+			row[i] ^= invert[i] & ~func[i];
+	}
+}
+
+
+constexpr bool QrCode::maskInverts(int msk, int x, int y) {
+	switch (msk) {
+		case 0:  return (x + y) % 2 == 0;
+		case 1:  return y % 2 == 0;
+		case 2:  return x % 3 == 0;
+		case 3:  return (x + y) % 3 == 0;
+		case 4:  return (x / 3 + y / 2) % 2 == 0;
+		case 5:  return x * y % 2 + x * y % 3 == 0;
+		case 6:  return (x * y % 2 + x * y % 3) % 2 == 0;
+		case 7:  return ((x + y) % 2 + x * y % 3) % 2 == 0;
+		default:  throw std::logic_error("Assertion error");
+	}
 }
 
 
 long QrCode::getPenaltyScore() const {
+	vector<uint64_t> columns(modules.size());
+	return getPenaltyScore(modules.data(), size, columns.data());
+}
+
+
+long QrCode::getPenaltyScore(const uint64_t *rows, int size, uint64_t *columns) {
 	long result = 0;
+	size_t rowWords = static_cast<size_t>((size + 63) / 64);
 	
 	// Adjacent modules in row having same color, and finder-like patterns
-	for (int y = 0; y < size; y++) {
-		bool runColor = false;
-		int runX = 0;
-		std::array<int,7> runHistory = {};
-		for (int x = 0; x < size; x++) {
-			if (module(x, y) == runColor) {
-				runX++;
-				if (runX == 5)
-					result += PENALTY_N1;
-				else if (runX > 5)
-					result++;
-			} else {
-				finderPenaltyAddHistory(runX, runHistory);
-				if (!runColor)
-					result += finderPenaltyCountPatterns(runHistory) * PENALTY_N3;
-				runColor = module(x, y);
-				runX = 1;
-			}
-		}
-		result += finderPenaltyTerminateAndCount(runColor, runX, runHistory) * PENALTY_N3;
-	}
+	for (int y = 0; y < size; y++)
+		result += linePenalty(&rows[static_cast<size_t>(y) * rowWords], size);
 	// Adjacent modules in column having same color, and finder-like patterns
-	for (int x = 0; x < size; x++) {
-		bool runColor = false;
-		int runY = 0;
-		std::array<int,7> runHistory = {};
-		for (int y = 0; y < size; y++) {
-			if (module(x, y) == runColor) {
-				runY++;
-				if (runY == 5)
-					result += PENALTY_N1;
-				else if (runY > 5)
-					result++;
-			} else {
-				finderPenaltyAddHistory(runY, runHistory);
-				if (!runColor)
-					result += finderPenaltyCountPatterns(runHistory) * PENALTY_N3;
-				runColor = module(x, y);
-				runY = 1;
-			}
-		}
-		result += finderPenaltyTerminateAndCount(runColor, runY, runHistory) * PENALTY_N3;
-	}
+	transposeGrid(rows, size, columns);
+	for (int x = 0; x < size; x++)
+		result += linePenalty(&columns[static_cast<size_t>(x) * rowWords], size);
 	
-	// 2*2 blocks of modules having same color
+	// 2*2 blocks of modules having same color, for the 64 blocks along a pair of rows at a time
 	for (int y = 0; y < size - 1; y++) {
-		for (int x = 0; x < size - 1; x++) {
-			bool  color = module(x, y);
-			if (  color == module(x + 1, y) &&
-			      color == module(x, y + 1) &&
-			      color == module(x + 1, y + 1))
-				result += PENALTY_N2;
+		const uint64_t *top    = &rows[static_cast<size_t>(y) * rowWords];
+		const uint64_t *bottom = top + rowWords;
+		for (size_t i = 0; i < rowWords; i++) {
+			// Bit x of the shifted words is module x + 1
+			uint64_t topNext    = (top   [i] >> 1) | (i + 1 < rowWords ? top   [i + 1] << 63 : 0);
+			uint64_t bottomNext = (bottom[i] >> 1) | (i + 1 < rowWords ? bottom[i + 1] << 63 : 0);
+			uint64_t same = ~(top[i] ^ bottom[i]) & ~(top[i] ^ topNext) & ~(bottom[i] ^ bottomNext);
+			// Only blocks whose left column x is at most size - 2
+			int valid = size - 1 - static_cast<int>(i) * 64;
+			if (valid < 64)
+				same &= (uint64_t(1) << valid) - 1;
+			result += __builtin_popcountll(same) * PENALTY_N2;
 		}
 	}
 	
 	// Balance of black and white modules
 	int black = 0;
-	for (const vector<bool> &row : modules) {
-		for (bool color : row) {
-			if (color)
-				black++;
-		}
-	}
+	for (size_t i = 0; i < static_cast<size_t>(size) * rowWords; i++)
+		black += __builtin_popcountll(rows[i]);
 	int total = size * size;  // Note that size is odd, so black/total != 1/2
 	// Compute the smallest integer k >= 0 such that (45-5k)% <= black/total <= (55+5k)%
 	int k = static_cast<int>((std::abs(black * 20L - total * 10L) + total - 1) / total) - 1;
@@ -692,6 +708,79 @@ long QrCode::getPenaltyScore() const {
 }
 
 
+long QrCode::linePenalty(const uint64_t *line, int size) {
+	long result = 0;
+	size_t lineWords = static_cast<size_t>((size + 63) / 64);
+	std::array<int,7> runHistory = {};
+	bool runColor = testBit(line, 0);
+	if (runColor) {
+		// The line starts with an empty white run
+		finderPenaltyAddHistory(0, runHistory, size);
+		result += finderPenaltyCountPatterns(runHistory, size) * PENALTY_N3;
+	}
+	int runStart = 0;
+	uint64_t carry = line[0] & 1;  // Module x - 1 for bit 0 of the current word
+	for (size_t i = 0; i < lineWords; i++) {
+		// Bit x is set where module x differs from module x - 1
+		uint64_t changes = line[i] ^ ((line[i] << 1) | carry);
+		carry = line[i] >> 63;
+		int end = std::min(size - static_cast<int>(i) * 64, 64);
+		if (end < 64)
+			changes &= (uint64_t(1) << end) - 1;
+		while (changes != 0) {
+			int x = static_cast<int>(i) * 64 + __builtin_ctzll(changes);
+			changes &= changes - 1;
+			int runLength = x - runStart;
+			if (runLength >= 5)
+				result += PENALTY_N1 + (runLength - 5);
+			finderPenaltyAddHistory(runLength, runHistory, size);
+			if (!runColor)
+				result += finderPenaltyCountPatterns(runHistory, size) * PENALTY_N3;
+			runColor = !runColor;
+			runStart = x;
+		}
+	}
+	int runLength = size - runStart;
+	if (runLength >= 5)
+		result += PENALTY_N1 + (runLength - 5);
+	result += finderPenaltyTerminateAndCount(runColor, runLength, runHistory, size) * PENALTY_N3;
+	return result;
+}
+
+
+void QrCode::transposeGrid(const uint64_t *rows, int size, uint64_t *out) {
+	size_t rowWords = static_cast<size_t>((size + 63) / 64);
+	uint64_t block[64];
+	for (size_t by = 0; by < rowWords; by++) {
+		for (size_t bx = 0; bx < rowWords; bx++) {
+			for (size_t i = 0; i < 64; i++) {
+				size_t y = by * 64 + i;
+				block[i] = y < static_cast<size_t>(size) ? rows[y * rowWords + bx] : 0;
+			}
+			transposeBlock(block);
+			for (size_t i = 0; i < 64; i++) {
+				size_t x = bx * 64 + i;
+				if (x < static_cast<size_t>(size))
+					out[x * rowWords + by] = block[i];
+			}
+		}
+	}
+}
+
+
+void QrCode::transposeBlock(uint64_t block[64]) {
+	// Swaps the off-diagonal 32*32 quadrants, then the 16*16 quadrants inside each of those, and so on
+	uint64_t mask = 0x00000000FFFFFFFFULL;
+	for (int j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+		for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+			uint64_t t = ((block[k] >> j) ^ block[k | j]) & mask;
+			block[k]     ^= t << j;
+			block[k | j] ^= t;
+		}
+	}
+}
+
+
 vector<int> QrCode::getAlignmentPatternPositions() const {
 	if (version == 1)
 		return vector<int>();
@@ -708,7 +797,7 @@ vector<int> QrCode::getAlignmentPatternPositions() const {
 }
 
 
-int QrCode::getNumRawDataModules(int ver) {
+constexpr int QrCode::getNumRawDataModules(int ver) {
 	if (ver < MIN_VERSION || ver > MAX_VERSION)
 		throw std::domain_error("Version number out of range");
 	int result = (16 * ver + 128) * ver + 64;
@@ -724,7 +813,7 @@ int QrCode::getNumRawDataModules(int ver) {
 }
 
 
-int QrCode::getNumDataCodewords(int ver, Ecc ecl) {
+constexpr int QrCode::getNumDataCodewords(int ver, Ecc ecl) {
 	return getNumRawDataModules(ver) / 8
 		- ECC_CODEWORDS_PER_BLOCK    [static_cast<int>(ecl)][ver]
 		* NUM_ERROR_CORRECTION_BLOCKS[static_cast<int>(ecl)][ver];
@@ -756,33 +845,69 @@ vector<uint8_t> QrCode::reedSolomonComputeDivisor(int degree) {
 }
 
 
+const vector<uint8_t> &QrCode::reedSolomonGetDivisor(int degree) {
+	if (degree < 1 || degree > MAX_ECC_CODEWORDS_PER_BLOCK)
+		throw std::domain_error("Degree out of range");
+	static const vector<vector<uint8_t> > divisors = []() {
+		vector<vector<uint8_t> > result(MAX_ECC_CODEWORDS_PER_BLOCK + 1);
+		for (int i = 1; i <= MAX_ECC_CODEWORDS_PER_BLOCK; i++)
+			result[static_cast<size_t>(i)] = reedSolomonComputeDivisor(i);
+		return result;
+	}();
+	return divisors[static_cast<size_t>(degree)];
+}
+
+
 vector<uint8_t> QrCode::reedSolomonComputeRemainder(const vector<uint8_t> &data, const vector<uint8_t> &divisor) {
-	vector<uint8_t> result(divisor.size());
+	size_t degree = divisor.size();
+	// The divisor's logs, with 0xFF marking zero coefficients (which no real generator has)
+	uint8_t divisorLog[255];
+	if (degree > sizeof(divisorLog))
+		throw std::domain_error("Degree out of range");
+	for (size_t i = 0; i < degree; i++)
+		divisorLog[i] = divisor[i] != 0 ? GF_TABLES.log[divisor[i]] : 0xFF;
+	
+	vector<uint8_t> result(degree);
+	uint8_t *rem = result.data();
 	for (uint8_t b : data) {  // Polynomial division
-		uint8_t factor = b ^ result.at(0);
-		result.erase(result.begin());
-		result.push_back(0);
-		for (size_t i = 0; i < result.size(); i++)
-			result.at(i) ^= reedSolomonMultiply(divisor.at(i), factor);
+		uint8_t factor = b ^ rem[0];
+		std::memmove(rem, rem + 1, degree - 1);
+		rem[degree - 1] = 0;
+		if (factor == 0)
+			continue;
+		int factorLog = GF_TABLES.log[factor];
+		for (size_t i = 0; i < degree; i++) {
+			if (divisorLog[i] != 0xFF)
+				rem[i] ^= GF_TABLES.exp[divisorLog[i] + factorLog];
+		}
 	}
 	return result;
 }
 
 
 uint8_t QrCode::reedSolomonMultiply(uint8_t x, uint8_t y) {
-	// Russian peasant multiplication
-	int z = 0;
-	for (int i = 7; i >= 0; i--) {
-		z = (z << 1) ^ ((z >> 7) * 0x11D);
-		z ^= ((y >> i) & 1) * x;
+	if (x == 0 || y == 0)
+		return 0;
+	return GF_TABLES.exp[GF_TABLES.log[x] + GF_TABLES.log[y]];
+}
+
+
+constexpr QrCode::GfTables QrCode::makeGfTables() {
+	GfTables tables{};
+	int x = 1;
+	for (int i = 0; i < 255; i++) {
+		tables.exp[i] = static_cast<uint8_t>(x);
+		tables.exp[i + 255] = static_cast<uint8_t>(x);
+		tables.log[x] = static_cast<uint8_t>(i);
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11D;
 	}
-	if (z >> 8 != 0)
-		throw std::logic_error("Assertion error");
-	return static_cast<uint8_t>(z);
+	return tables;
 }
 
 
-int QrCode::finderPenaltyCountPatterns(const std::array<int,7> &runHistory) const {
+int QrCode::finderPenaltyCountPatterns(const std::array<int,7> &runHistory, int size) {
 	int n = runHistory.at(1);
 	if (n > size * 3)
 		throw std::logic_error("Assertion error");
@@ -792,18 +917,18 @@ int QrCode::finderPenaltyCountPatterns(const std::array<int,7> &runHistory) cons
 }
 
 
-int QrCode::finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, std::array<int,7> &runHistory) const {
+int QrCode::finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, std::array<int,7> &runHistory, int size) {
 	if (currentRunColor) {  // Terminate black run
-		finderPenaltyAddHistory(currentRunLength, runHistory);
+		finderPenaltyAddHistory(currentRunLength, runHistory, size);
 		currentRunLength = 0;
 	}
 	currentRunLength += size;  // Add white border to final run
-	finderPenaltyAddHistory(currentRunLength, runHistory);
-	return finderPenaltyCountPatterns(runHistory);
+	finderPenaltyAddHistory(currentRunLength, runHistory, size);
+	return finderPenaltyCountPatterns(runHistory, size);
 }
 
 
-void QrCode::finderPenaltyAddHistory(int currentRunLength, std::array<int,7> &runHistory) const {
+void QrCode::finderPenaltyAddHistory(int currentRunLength, std::array<int,7> &runHistory, int size) {
 	if (runHistory.at(0) == 0)
 		currentRunLength += size;  // Add white border to initial run
 	std::copy_backward(runHistory.cbegin(), runHistory.cend() - 1, runHistory.end());
@@ -824,23 +949,7 @@ const int QrCode::PENALTY_N3 = 40;
 const int QrCode::PENALTY_N4 = 10;
 
 
-const int8_t QrCode::ECC_CODEWORDS_PER_BLOCK[4][41] = {
-	// Version: (note that index 0 is for padding, and is set to an illegal value)
-	//0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40    Error correction level
-	{-1,  7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24, 28, 30, 28, 28, 28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},  // Low
-	{-1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28, 26, 26, 26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28},  // Medium
-	{-1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24, 28, 28, 26, 30, 28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},  // Quartile
-	{-1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30, 28, 28, 26, 28, 30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},  // High
-};
-
-const int8_t QrCode::NUM_ERROR_CORRECTION_BLOCKS[4][41] = {
-	// Version: (note that index 0 is for padding, and is set to an illegal value)
-	//0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40    Error correction level
-	{-1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4,  4,  4,  4,  4,  6,  6,  6,  6,  7,  8,  8,  9,  9, 10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22, 24, 25},  // Low
-	{-1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5,  5,  8,  9,  9, 10, 10, 11, 13, 14, 16, 17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47, 49},  // Medium
-	{-1, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8,  8, 10, 12, 16, 12, 17, 16, 18, 21, 20, 23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56, 59, 62, 65, 68},  // Quartile
-	{-1, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21, 25, 25, 25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63, 66, 70, 74, 77, 81},  // High
-};
+constexpr QrCode::GfTables QrCode::GF_TABLES = makeGfTables();
 
 
 data_too_long::data_too_long(const std::string &msg) :
@@ -23,8 +23,12 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <climits>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -249,7 +253,7 @@ class QrCode final {
 	
 	
 	// Returns a value in the range 0 to 3 (unsigned 2-bit integer).
-	private: static int getFormatBits(Ecc ecl);
+	private: static constexpr int getFormatBits(Ecc ecl);
 	
 	
 	
@@ -313,13 +317,18 @@ class QrCode final {
 	private: int mask;
 	
 	// Private grids of modules/pixels, with dimensions of size*size:
+	// Each row is packed into wordsPerRow 64-bit words, module x of a row being bit (x % 64) of word (x / 64).
+	// Bits past the end of a row are always 0.
 	
-	// The modules of this QR Code (false = white, true = black).
-	// Immutable after constructor finishes. Accessed through getModule().
-	private: std::vector<std::vector<bool> > modules;
+	/* The number of 64-bit words in each packed row, which is (size + 63) / 64. */
+	private: int wordsPerRow;
+	
+	// The modules of this QR Code (0 = white, 1 = black).
+	// Immutable after constructor finishes. Accessed through getModule() and getRow().
+	private: std::vector<std::uint64_t> modules;
 	
 	// Indicates function modules that are not subjected to masking. Discarded when constructor finishes.
-	private: std::vector<std::vector<bool> > isFunction;
+	private: std::vector<std::uint64_t> isFunction;
 	
 	
 	
@@ -369,6 +378,20 @@ class QrCode final {
 	public: bool getModule(int x, int y) const;
 	
 	
+	/* 
+	 * Returns the packed modules of row y, which must be in the range [0, size).
+	 * Module x is bit (x % 64) of word (x / 64), set for black. There are
+	 * getWordsPerRow() words, and bits past the end of the row are 0.
+	 */
+	public: const std::uint64_t *getRow(int y) const;
+	
+	
+	/* 
+	 * Returns the number of 64-bit words in each row returned by getRow().
+	 */
+	public: int getWordsPerRow() const;
+	
+	
 	/* 
 	 * Returns a string of SVG code for an image depicting this QR Code, with the given number
 	 * of border modules. The string always uses Unix newlines (\n), regardless of the platform.
@@ -412,6 +435,14 @@ class QrCode final {
 	private: bool module(int x, int y) const;
 	
 	
+	// Sets or clears bit x of the packed row starting at row.
+	private: static void setBit(std::uint64_t *row, int x, bool value);
+	
+	
+	// Returns bit x of the packed row starting at row.
+	private: static bool testBit(const std::uint64_t *row, int x);
+	
+	
 	/*---- Private helper methods for constructor: Codewords and masking ----*/
 	
 	// Returns a new byte string representing the given data with the appropriate error correction
@@ -432,11 +463,34 @@ class QrCode final {
 	private: void applyMask(int msk);
 	
 	
+	// Returns whether the given mask pattern inverts the module at (x, y). Every pattern
+	// repeats every MASK_PERIOD modules in both directions.
+	private: static constexpr bool maskInverts(int msk, int x, int y);
+	
+	
 	// Calculates and returns the penalty score based on state of this QR Code's current modules.
 	// This is used by the automatic mask choice algorithm to find the mask pattern that yields the lowest score.
 	private: long getPenaltyScore() const;
 	
 	
+	// Calculates the penalty score of a size*size grid of packed rows laid out like getRow().
+	// columns must have room for as many words as rows, and is overwritten with the transposed grid.
+	private: static long getPenaltyScore(const std::uint64_t *rows, int size, std::uint64_t *columns);
+	
+	
+	// Returns the run length and finder-like pattern penalties of one packed row or column of modules.
+	// Runs are found a word at a time by counting trailing zeros of the colour change bits.
+	private: static long linePenalty(const std::uint64_t *line, int size);
+	
+	
+	// Writes the size*size grid of packed rows transposed to out, so that row x of out is column x of rows.
+	private: static void transposeGrid(const std::uint64_t *rows, int size, std::uint64_t *out);
+	
+	
+	// Transposes a 64*64 bit block in place, where bit j of block[i] is the bit at row i, column j.
+	private: static void transposeBlock(std::uint64_t block[64]);
+	
+	
 	
 	/*---- Private helper functions ----*/
 	
@@ -449,13 +503,13 @@ class QrCode final {
 	// Returns the number of data bits that can be stored in a QR Code of the given version number, after
 	// all function modules are excluded. This includes remainder bits, so it might not be a multiple of 8.
 	// The result is in the range [208, 29648]. This could be implemented as a 40-entry lookup table.
-	private: static int getNumRawDataModules(int ver);
+	private: static constexpr int getNumRawDataModules(int ver);
 	
 	
 	// Returns the number of 8-bit data (i.e. not error correction) codewords contained in any
 	// QR Code of the given version number and error correction level, with remainder bits discarded.
 	// This stateless pure function could be implemented as a (40*4)-cell lookup table.
-	private: static int getNumDataCodewords(int ver, Ecc ecl);
+	private: static constexpr int getNumDataCodewords(int ver, Ecc ecl);
 	
 	
 	// Returns a Reed-Solomon ECC generator polynomial for the given degree. This could be
@@ -463,26 +517,43 @@ class QrCode final {
 	private: static std::vector<std::uint8_t> reedSolomonComputeDivisor(int degree);
 	
 	
+	// Returns the generator polynomial for the given degree. Every degree used by a QR Code
+	// is computed once, on first use, and shared after that.
+	private: static const std::vector<std::uint8_t> &reedSolomonGetDivisor(int degree);
+	
+	
 	// Returns the Reed-Solomon error correction codeword for the given data and divisor polynomials.
 	private: static std::vector<std::uint8_t> reedSolomonComputeRemainder(const std::vector<std::uint8_t> &data, const std::vector<std::uint8_t> &divisor);
 	
 	
 	// Returns the product of the two given field elements modulo GF(2^8/0x11D).
-	// All inputs are valid. This could be implemented as a 256*256 lookup table.
+	// All inputs are valid. Uses the log and antilog tables in GF_TABLES.
 	private: static std::uint8_t reedSolomonMultiply(std::uint8_t x, std::uint8_t y);
 	
 	
+	// Log and antilog tables for GF(2^8/0x11D) with generator 0x02. exp is doubled in length,
+	// so the sum of two logs can index it without a modulo. log[0] is unused.
+	private: struct GfTables {
+		std::uint8_t exp[510];
+		std::uint8_t log[256];
+	};
+	
+	private: static constexpr GfTables makeGfTables();
+	
+	private: static const GfTables GF_TABLES;
+	
+	
 	// Can only be called immediately after a white run is added, and
 	// returns either 0, 1, or 2. A helper function for getPenaltyScore().
-	private: int finderPenaltyCountPatterns(const std::array<int,7> &runHistory) const;
+	private: static int finderPenaltyCountPatterns(const std::array<int,7> &runHistory, int size);
 	
 	
 	// Must be called at the end of a line (row or column) of modules. A helper function for getPenaltyScore().
-	private: int finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, std::array<int,7> &runHistory) const;
+	private: static int finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, std::array<int,7> &runHistory, int size);
 	
 	
 	// Pushes the given value to the front and drops the last value. A helper function for getPenaltyScore().
-	private: void finderPenaltyAddHistory(int currentRunLength, std::array<int,7> &runHistory) const;
+	private: static void finderPenaltyAddHistory(int currentRunLength, std::array<int,7> &runHistory, int size);
 	
 	
 	// Returns true iff the i'th bit of x is set to 1.
@@ -498,6 +569,12 @@ class QrCode final {
 	public: static constexpr int MAX_VERSION = 40;
 	
 	
+	// The horizontal and vertical period shared by all 8 mask patterns.
+	private: static constexpr int MASK_PERIOD = 12;
+	
+	// The largest number of ECC codewords per block in any version and ECC level.
+	private: static constexpr int MAX_ECC_CODEWORDS_PER_BLOCK = 30;
+	
 	// For use in getPenaltyScore(), when evaluating which mask is best.
 	private: static const int PENALTY_N1;
 	private: static const int PENALTY_N2;
@@ -505,8 +582,27 @@ class QrCode final {
 	private: static const int PENALTY_N4;
 	
 	
-	private: static const std::int8_t ECC_CODEWORDS_PER_BLOCK[4][41];
-	private: static const std::int8_t NUM_ERROR_CORRECTION_BLOCKS[4][41];
+	private: static constexpr std::int8_t ECC_CODEWORDS_PER_BLOCK[4][41] = {
+		// Version: (note that index 0 is for padding, and is set to an illegal value)
+		//0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40    Error correction level
+		{-1,  7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24, 28, 30, 28, 28, 28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},  // Low
+		{-1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28, 26, 26, 26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28},  // Medium
+		{-1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24, 28, 28, 26, 30, 28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},  // Quartile
+		{-1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30, 28, 28, 26, 28, 30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},  // High
+	};
+	
+	private: static constexpr std::int8_t NUM_ERROR_CORRECTION_BLOCKS[4][41] = {
+		// Version: (note that index 0 is for padding, and is set to an illegal value)
+		//0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40    Error correction level
+		{-1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4,  4,  4,  4,  4,  6,  6,  6,  6,  7,  8,  8,  9,  9, 10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22, 24, 25},  // Low
+		{-1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5,  5,  8,  9,  9, 10, 10, 11, 13, 14, 16, 17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47, 49},  // Medium
+		{-1, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8,  8, 10, 12, 16, 12, 17, 16, 18, 21, 20, 23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56, 59, 62, 65, 68},  // Quartile
+		{-1, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21, 25, 25, 25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63, 66, 70, 74, 77, 81},  // High
+	};
+	
+	
+	// Reuses the tables, Reed-Solomon arithmetic and penalty scoring.
+	template <int DATA_LEN, Ecc ECL> friend class FixedQrEncoder;
 	
 };
 
@@ -553,4 +649,362 @@ class BitBuffer final : public std::vector<bool> {
 	
 };
 
+
+/* 
+ * A QR Code encoder specialised for binary payloads of exactly DATA_LEN bytes at error correction
+ * level ECL. It gives the same symbol as QrCode::encodeBinary() with the same arguments.
+ * The version, block structure, function patterns, format bits and codeword placement order are
+ * all worked out at compile time. Encoding only fills in the codewords, computes the ECC, places
+ * the bits and scores the 8 masks, and nothing is allocated on the heap.
+ */
+template <int DATA_LEN, QrCode::Ecc ECL>
+class FixedQrEncoder final {
+	
+	/*---- Symbol shape ----*/
+	
+	// Number of bits in the character count of a byte mode segment, or 0 if DATA_LEN doesn't fit.
+	private: static constexpr int charCountBits(int ver) {
+		int bits = ver <= 9 ? 8 : 16;
+		return DATA_LEN < (1L << bits) ? bits : 0;
+	}
+	
+	// The smallest version that fits the payload, as chosen by QrCode::encodeSegments(), or 0 if none do.
+	private: static constexpr int findVersion() {
+		for (int ver = QrCode::MIN_VERSION; ver <= QrCode::MAX_VERSION; ver++) {
+			if (charCountBits(ver) != 0 && 4 + charCountBits(ver) + DATA_LEN * 8 <= QrCode::getNumDataCodewords(ver, ECL) * 8)
+				return ver;
+		}
+		return 0;
+	}
+	
+	public: static constexpr int VERSION = findVersion();
+	static_assert(VERSION != 0, "Payload too long for a QR Code");
+	
+	private: static constexpr int DATA_USED_BITS = 4 + charCountBits(VERSION) + DATA_LEN * 8;
+	
+	// The error correction level after boosting it as far as the version allows, like QrCode::encodeSegments().
+	private: static constexpr QrCode::Ecc boostEcl() {
+		QrCode::Ecc ecl = ECL;
+		for (QrCode::Ecc newEcl : {QrCode::Ecc::MEDIUM, QrCode::Ecc::QUARTILE, QrCode::Ecc::HIGH}) {
+			if (DATA_USED_BITS <= QrCode::getNumDataCodewords(VERSION, newEcl) * 8)
+				ecl = newEcl;
+		}
+		return ecl;
+	}
+	
+	public: static constexpr QrCode::Ecc ECC_LEVEL = boostEcl();
+	
+	public: static constexpr int SIZE = VERSION * 4 + 17;
+	
+	public: static constexpr int WORDS_PER_ROW = (SIZE + 63) / 64;
+	
+	private: static constexpr int GRID_WORDS = SIZE * WORDS_PER_ROW;
+	
+	private: static constexpr int NUM_BLOCKS = QrCode::NUM_ERROR_CORRECTION_BLOCKS[static_cast<int>(ECC_LEVEL)][VERSION];
+	
+	private: static constexpr int BLOCK_ECC_LEN = QrCode::ECC_CODEWORDS_PER_BLOCK[static_cast<int>(ECC_LEVEL)][VERSION];
+	
+	private: static constexpr int RAW_CODEWORDS = QrCode::getNumRawDataModules(VERSION) / 8;
+	
+	private: static constexpr int DATA_CODEWORDS = QrCode::getNumDataCodewords(VERSION, ECC_LEVEL);
+	
+	private: static constexpr int NUM_SHORT_BLOCKS = NUM_BLOCKS - RAW_CODEWORDS % NUM_BLOCKS;
+	
+	// Data codewords in a short block. Long blocks have one more.
+	private: static constexpr int SHORT_BLOCK_DATA_LEN = RAW_CODEWORDS / NUM_BLOCKS - BLOCK_ECC_LEN;
+	
+	// The mode and character count leave the payload 4 bits off a byte boundary, which encode() relies on.
+	static_assert(DATA_USED_BITS % 8 == 4, "Unexpected segment header length");
+	
+	
+	
+	/*---- Compile time layout ----*/
+	
+	// The codewords are built in one buffer: every block's data codewords in order,
+	// followed by each block's ECC codewords in turn.
+	private: static constexpr int blockDataStart(int block) {
+		return block * SHORT_BLOCK_DATA_LEN + (block > NUM_SHORT_BLOCKS ? block - NUM_SHORT_BLOCKS : 0);
+	}
+	
+	private: static constexpr int blockDataLen(int block) {
+		return SHORT_BLOCK_DATA_LEN + (block >= NUM_SHORT_BLOCKS ? 1 : 0);
+	}
+	
+	// A grid of packed rows that records which modules are function modules, as QrCode's constructor draws them.
+	private: struct Grid {
+		std::uint64_t modules[GRID_WORDS];
+		std::uint64_t isFunction[GRID_WORDS];
+		
+		constexpr void setFunctionModule(int x, int y, bool isBlack) {
+			std::uint64_t bit = std::uint64_t(1) << (x & 63);
+			int word = y * WORDS_PER_ROW + (x >> 6);
+			if (isBlack)
+				modules[word] |= bit;
+			else
+				modules[word] &= ~bit;
+			isFunction[word] |= bit;
+		}
+		
+		constexpr bool isFunctionModule(int x, int y) const {
+			return ((isFunction[y * WORDS_PER_ROW + (x >> 6)] >> (x & 63)) & 1) != 0;
+		}
+	};
+	
+	// Same as QrCode::drawFormatBits()
+	private: static constexpr void drawFormatBits(Grid &grid, int msk) {
+		int data = QrCode::getFormatBits(ECC_LEVEL) << 3 | msk;
+		int rem = data;
+		for (int i = 0; i < 10; i++)
+			rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+		int bits = (data << 10 | rem) ^ 0x5412;
+		for (int i = 0; i <= 5; i++)
+			grid.setFunctionModule(8, i, (bits >> i) & 1);
+		grid.setFunctionModule(8, 7, (bits >> 6) & 1);
+		grid.setFunctionModule(8, 8, (bits >> 7) & 1);
+		grid.setFunctionModule(7, 8, (bits >> 8) & 1);
+		for (int i = 9; i < 15; i++)
+			grid.setFunctionModule(14 - i, 8, (bits >> i) & 1);
+		for (int i = 0; i < 8; i++)
+			grid.setFunctionModule(SIZE - 1 - i, 8, (bits >> i) & 1);
+		for (int i = 8; i < 15; i++)
+			grid.setFunctionModule(8, SIZE - 15 + i, (bits >> i) & 1);
+		grid.setFunctionModule(8, SIZE - 8, true);  // Always black
+	}
+	
+	// Same as QrCode::drawFunctionPatterns(), with the format bits for mask 0
+	private: static constexpr Grid makeFunctionPatterns() {
+		Grid grid{};
+		for (int i = 0; i < SIZE; i++) {
+			grid.setFunctionModule(6, i, i % 2 == 0);
+			grid.setFunctionModule(i, 6, i % 2 == 0);
+		}
+		for (int corner = 0; corner < 3; corner++) {
+			int cx = corner == 1 ? SIZE - 4 : 3;
+			int cy = corner == 2 ? SIZE - 4 : 3;
+			for (int dy = -4; dy <= 4; dy++) {
+				for (int dx = -4; dx <= 4; dx++) {
+					int dist = std::max(std::abs(dx), std::abs(dy));
+					int xx = cx + dx, yy = cy + dy;
+					if (0 <= xx && xx < SIZE && 0 <= yy && yy < SIZE)
+						grid.setFunctionModule(xx, yy, dist != 2 && dist != 4);
+				}
+			}
+		}
+		if (VERSION > 1) {
+			// Same positions as QrCode::getAlignmentPatternPositions()
+			int numAlign = VERSION / 7 + 2;
+			int step = (VERSION == 32) ? 26 : (VERSION * 4 + numAlign * 2 + 1) / (numAlign * 2 - 2) * 2;
+			int positions[7] = {};
+			positions[0] = 6;
+			for (int i = numAlign - 1, pos = SIZE - 7; i >= 1; i--, pos -= step)
+				positions[i] = pos;
+			for (int i = 0; i < numAlign; i++) {
+				for (int j = 0; j < numAlign; j++) {
+					if ((i == 0 && j == 0) || (i == 0 && j == numAlign - 1) || (i == numAlign - 1 && j == 0))
+						continue;
+					for (int dy = -2; dy <= 2; dy++) {
+						for (int dx = -2; dx <= 2; dx++)
+							grid.setFunctionModule(positions[i] + dx, positions[j] + dy, std::max(std::abs(dx), std::abs(dy)) != 1);
+					}
+				}
+			}
+		}
+		drawFormatBits(grid, 0);
+		if (VERSION >= 7) {
+			int rem = VERSION;
+			for (int i = 0; i < 12; i++)
+				rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+			long bits = static_cast<long>(VERSION) << 12 | rem;
+			for (int i = 0; i < 18; i++) {
+				bool bit = (bits >> i) & 1;
+				int a = SIZE - 11 + i % 3;
+				int b = i / 3;
+				grid.setFunctionModule(a, b, bit);
+				grid.setFunctionModule(b, a, bit);
+			}
+		}
+		return grid;
+	}
+	
+	private: struct Layout {
+		// For each mask, the function modules with that mask's format bits, and the mask's
+		// pattern on every other module. XORing in the placed codewords gives the final symbol.
+		std::uint64_t masked[8][GRID_WORDS];
+		// Where bit 7 - (i % 8) of codeword buffer byte i / 8 goes, as y * WORDS_PER_ROW * 64 + x
+		std::uint16_t bitPositions[RAW_CODEWORDS * 8];
+		// Logs of the generator polynomial's coefficients, highest power first without the leading 1
+		std::uint8_t generatorLog[BLOCK_ECC_LEN];
+	};
+	
+	private: static constexpr Layout makeLayout() {
+		Layout layout{};
+		const Grid functions = makeFunctionPatterns();
+		
+		for (int msk = 0; msk < 8; msk++) {
+			Grid grid = functions;
+			drawFormatBits(grid, msk);
+			for (int y = 0; y < SIZE; y++) {
+				for (int x = 0; x < SIZE; x++) {
+					int word = y * WORDS_PER_ROW + (x >> 6);
+					if (!grid.isFunctionModule(x, y) && QrCode::maskInverts(msk, x, y))
+						grid.modules[word] |= std::uint64_t(1) << (x & 63);
+				}
+			}
+			for (int i = 0; i < GRID_WORDS; i++)
+				layout.masked[msk][i] = grid.modules[i];
+		}
+		
+		// The buffer index of each codeword in the interleaved order of QrCode::addEccAndInterleave()
+		int order[RAW_CODEWORDS] = {};
+		int count = 0;
+		for (int i = 0; i <= SHORT_BLOCK_DATA_LEN + BLOCK_ECC_LEN; i++) {
+			for (int block = 0; block < NUM_BLOCKS; block++) {
+				if (i < blockDataLen(block))
+					order[count++] = blockDataStart(block) + i;
+				else if (i > SHORT_BLOCK_DATA_LEN)
+					order[count++] = DATA_CODEWORDS + block * BLOCK_ECC_LEN + (i - SHORT_BLOCK_DATA_LEN - 1);
+			}
+		}
+		if (count != RAW_CODEWORDS)
+			throw std::logic_error("Assertion error");
+		
+		// The zigzag scan of QrCode::drawCodewords()
+		int bit = 0;
+		for (int right = SIZE - 1; right >= 1; right -= 2) {
+			if (right == 6)
+				right = 5;
+			for (int vert = 0; vert < SIZE; vert++) {
+				for (int j = 0; j < 2; j++) {
+					int x = right - j;
+					bool upward = ((right + 1) & 2) == 0;
+					int y = upward ? SIZE - 1 - vert : vert;
+					if (!functions.isFunctionModule(x, y) && bit < RAW_CODEWORDS * 8) {
+						layout.bitPositions[order[bit >> 3] * 8 + (bit & 7)] = static_cast<std::uint16_t>(y * WORDS_PER_ROW * 64 + x);
+						bit++;
+					}
+				}
+			}
+		}
+		if (bit != RAW_CODEWORDS * 8)
+			throw std::logic_error("Assertion error");
+		
+		// Same as QrCode::reedSolomonComputeDivisor(), kept as logs
+		std::uint8_t generator[BLOCK_ECC_LEN] = {};
+		generator[BLOCK_ECC_LEN - 1] = 1;
+		std::uint8_t root = 1;
+		for (int i = 0; i < BLOCK_ECC_LEN; i++) {
+			for (int j = 0; j < BLOCK_ECC_LEN; j++) {
+				generator[j] = gfMultiply(generator[j], root);
+				if (j + 1 < BLOCK_ECC_LEN)
+					generator[j] ^= generator[j + 1];
+			}
+			root = gfMultiply(root, 0x02);
+		}
+		for (int i = 0; i < BLOCK_ECC_LEN; i++) {
+			if (generator[i] == 0)
+				throw std::logic_error("Generator has a zero coefficient");
+			layout.generatorLog[i] = QrCode::GF_TABLES.log[generator[i]];
+		}
+		return layout;
+	}
+	
+	private: static constexpr std::uint8_t gfMultiply(std::uint8_t x, std::uint8_t y) {
+		if (x == 0 || y == 0)
+			return 0;
+		return QrCode::GF_TABLES.exp[QrCode::GF_TABLES.log[x] + QrCode::GF_TABLES.log[y]];
+	}
+	
+	private: static constexpr Layout LAYOUT = makeLayout();
+	
+	
+	
+	/*---- Encoding ----*/
+	
+	/* 
+	 * An encoded symbol, with its modules packed the same way as QrCode::getRow().
+	 */
+	public: struct Symbol {
+		int mask;
+		std::uint64_t modules[GRID_WORDS];
+		
+		int getSize() const {
+			return SIZE;
+		}
+		
+		const std::uint64_t *getRow(int y) const {
+			return &modules[y * WORDS_PER_ROW];
+		}
+		
+		bool getModule(int x, int y) const {
+			return 0 <= x && x < SIZE && 0 <= y && y < SIZE && ((getRow(y)[x >> 6] >> (x & 63)) & 1) != 0;
+		}
+	};
+	
+	
+	/* 
+	 * Encodes the DATA_LEN bytes at data into out, choosing the mask the same way as QrCode.
+	 */
+	public: static void encode(const std::uint8_t *data, Symbol &out) {
+		std::uint8_t codewords[RAW_CODEWORDS];
+		
+		// Byte mode indicator and character count, then the payload, which all ends up 4 bits
+		// into a byte. The terminator fills that last nibble and the rest is padding bytes.
+		std::uint32_t pending = 0x4u << charCountBits(VERSION) | DATA_LEN;
+		int pendingBits = 4 + charCountBits(VERSION);
+		int pos = 0;
+		for (; pendingBits >= 8; pendingBits -= 8)
+			codewords[pos++] = static_cast<std::uint8_t>(pending >> (pendingBits - 8));
+		for (int i = 0; i < DATA_LEN; i++) {
+			pending = pending << 8 | data[i];
+			codewords[pos++] = static_cast<std::uint8_t>(pending >> 4);
+		}
+		codewords[pos++] = static_cast<std::uint8_t>(pending << 4);
+		for (std::uint8_t padByte = 0xEC; pos < DATA_CODEWORDS; padByte ^= 0xEC ^ 0x11)
+			codewords[pos++] = padByte;
+		
+		// Reed-Solomon ECC for each block
+		for (int block = 0; block < NUM_BLOCKS; block++) {
+			std::uint8_t *ecc = &codewords[DATA_CODEWORDS + block * BLOCK_ECC_LEN];
+			std::fill(ecc, ecc + BLOCK_ECC_LEN, 0);
+			const std::uint8_t *blockData = &codewords[blockDataStart(block)];
+			for (int i = 0; i < blockDataLen(block); i++) {
+				std::uint8_t factor = blockData[i] ^ ecc[0];
+				std::memmove(ecc, ecc + 1, BLOCK_ECC_LEN - 1);
+				ecc[BLOCK_ECC_LEN - 1] = 0;
+				if (factor == 0)
+					continue;
+				int factorLog = QrCode::GF_TABLES.log[factor];
+				for (int j = 0; j < BLOCK_ECC_LEN; j++)
+					ecc[j] ^= QrCode::GF_TABLES.exp[LAYOUT.generatorLog[j] + factorLog];
+			}
+		}
+		
+		// Place the codeword bits
+		std::uint64_t placed[GRID_WORDS] = {};
+		for (int i = 0; i < RAW_CODEWORDS; i++) {
+			const std::uint16_t *positions = &LAYOUT.bitPositions[i * 8];
+			for (int j = 0; j < 8; j++) {
+				if ((codewords[i] >> (7 - j)) & 1)
+					placed[positions[j] >> 6] |= std::uint64_t(1) << (positions[j] & 63);
+			}
+		}
+		
+		// Score every mask, ties going to the lowest
+		long minPenalty = LONG_MAX;
+		std::uint64_t columns[GRID_WORDS];
+		for (int msk = 0; msk < 8; msk++) {
+			for (int i = 0; i < GRID_WORDS; i++)
+				out.modules[i] = placed[i] ^ LAYOUT.masked[msk][i];
+			long penalty = QrCode::getPenaltyScore(out.modules, SIZE, columns);
+			if (penalty < minPenalty) {
+				out.mask = msk;
+				minPenalty = penalty;
+			}
+		}
+		for (int i = 0; i < GRID_WORDS; i++)
+			out.modules[i] = placed[i] ^ LAYOUT.masked[out.mask][i];
+	}
+	
+};
+
 }
@@ -10,6 +10,7 @@
 #undef private
 
 #include "miiport.hpp"
+#include "thumbnail.h"
 
 
 const AppletType APPLET_TYPE = appletGetAppletType();
@@ -120,6 +121,162 @@ class FocusHeader : public brls::Header {
         }
 };
 
+/*
+ * Loads thumbnails for the list items near the focused one, instead of every image at startup.
+ * The loader thread takes them from the on-SD thumbnail cache when the image hasn't changed,
+ * otherwise it decodes them and adds them to the cache.
+ */
+class LazyThumbnails {
+    private:
+        // items either side of the focused one to load
+        static const int LOAD_AHEAD = 8;
+        ThumbnailCache cache;
+        ThumbnailLoader loader;
+        std::vector<brls::ListItem*> items;
+        std::vector<std::string> paths;
+        std::vector<bool> requested;
+        std::vector<thumbnailImage> finished;
+
+        void setThumbnail(const thumbnailImage& thumbnail) {
+            brls::Image* image = new brls::Image();
+            image->setScaleType(brls::ImageScaleType::FIT);
+            image->setImageRGBA((u8*)thumbnail.rgba.data(), thumbnail.width, thumbnail.height);
+            items[thumbnail.id]->setThumbnail(image);
+        }
+
+    public:
+        LazyThumbnails() : cache(THUMBNAIL_CACHE_PATH), loader(cache) {
+            cache.load();
+        }
+
+        ~LazyThumbnails() {
+            cache.save();
+        }
+
+        void add(brls::ListItem* item, const std::string& path) {
+            size_t id = items.size();
+            items.push_back(item);
+            paths.push_back(path);
+            cache.keep(hash64(path.data(), path.size()));
+            requested.push_back(false);
+            item->getFocusEvent()->subscribe([this, id](brls::View* view) {
+                requestAround(id);
+            });
+        }
+
+        void requestAround(size_t id) {
+            if(items.empty()) {
+                return;
+            }
+            size_t first = id > LOAD_AHEAD ? id - LOAD_AHEAD : 0;
+            size_t last = std::min(id + LOAD_AHEAD, items.size() - 1);
+            // farthest first, as the loader works newest first
+            for(size_t i = last + 1; i-- > first;) {
+                if(requested[i]) {
+                    continue;
+                }
+                requested[i] = true;
+                loader.request(i, paths[i]);
+            }
+        }
+
+        // Creates images for finished thumbnails. Must be called from the UI thread.
+        void upload() {
+            if(!loader.takeReady(finished)) {
+                return;
+            }
+            for(const thumbnailImage& thumbnail : finished) {
+                setThumbnail(thumbnail);
+            }
+            finished.clear();
+        }
+};
+
+/*
+ * Runs importMiiQrs on a background thread so the UI keeps running while a folder is imported.
+ * Progress is shown as the list item's value, and poll() notifies the result when it finishes.
+ */
+class BackgroundQrImport {
+    private:
+        std::vector<fs::path> paths;
+        brls::ListItem* item = nullptr;
+        std::thread thread;
+        std::atomic<size_t> files_done{0};
+        std::atomic<bool> finished{false};
+        bool running = false;
+        size_t shown_done = 0;
+        miiQrImportReport report;
+        Result result = 0;
+
+        std::string imagesText(size_t done) {
+            std::stringstream ss;
+            if(running) {
+                ss << done << " of ";
+            }
+            ss << paths.size() << " images";
+            return ss.str();
+        }
+
+    public:
+        ~BackgroundQrImport() {
+            wait();
+        }
+
+        // Blocks until a running import is done
+        void wait() {
+            if(thread.joinable()) {
+                thread.join();
+            }
+        }
+
+        // Does nothing if an import is already running
+        void start(const std::vector<fs::path>& import_paths, brls::ListItem* list_item) {
+            if(running) {
+                return;
+            }
+            paths = import_paths;
+            item = list_item;
+            running = true;
+            finished = false;
+            files_done = 0;
+            shown_done = 0;
+            // initialize on this thread, it isn't safe to do from the import threads
+            getStoreDataCrcContext();
+            item->setValue(imagesText(0));
+            thread = std::thread([this] {
+                result = importMiiQrs(paths, &report, 0, QR_PREFILTER_ON, &files_done);
+                finished = true;
+            });
+        }
+
+        // Updates the progress and reports the result once done. Must be called from the UI thread.
+        void poll() {
+            if(!running) {
+                return;
+            }
+            if(!finished) {
+                size_t done = files_done;
+                if(done != shown_done) {
+                    shown_done = done;
+                    item->setValue(imagesText(done));
+                }
+                return;
+            }
+            thread.join();
+            running = false;
+            item->setValue(imagesText(paths.size()));
+            printMiiQrImportReport(report);
+            if(report.imported == 0) {
+                errorNotify(result);
+                return;
+            }
+            std::stringstream ss;
+            ss << "Imported " << report.imported << " Miis from " << paths.size() << " images";
+            ss << std::fixed << std::setprecision(1) << " (" << report.images_per_sec << " images/s)";
+            brls::Application::notify(ss.str());
+        }
+};
+
 const std::string TITLE = "MiiPort";
 
 int main(int argc, char* argv[]) {
@@ -177,16 +334,31 @@ int main(int argc, char* argv[]) {
     const fs::path import_path = "/MiiPort/miis";
 
     FocusList* fileList = new FocusList(true);
+    LazyThumbnails thumbnails;
+    BackgroundQrImport qr_import;
 
     fs::create_directories(import_path);
     std::vector<fs::directory_entry> dirEntVec;
     // iterator does not give unicode paths at all
     std::copy(fs::directory_iterator(import_path), fs::directory_iterator(), std::back_inserter(dirEntVec));
     std::sort(dirEntVec.begin(), dirEntVec.end());
+    std::vector<fs::path> qr_paths;
+    for(const fs::path& path: dirEntVec) {
+        if(isJpegPath(path)) {
+            qr_paths.push_back(path);
+        }
+    }
+    if(qr_paths.size() > 1) {
+        brls::ListItem* importAllItem = new brls::ListItem("Import all QR images", "", std::to_string(qr_paths.size()) + " images");
+        importAllItem->getClickEvent()->subscribe([qr_paths{std::move(qr_paths)}, importAllItem, &qr_import](brls::View* view) {
+            qr_import.start(qr_paths, importAllItem);
+        });
+        fileList->addView(importAllItem);
+    }
     for(fs::path path: dirEntVec) {
         brls::ListItem* fileItem = new brls::ListItem(path.filename());
-        if(path.extension() == ".jpg") {
-            fileItem->setThumbnail(path);
+        if(isJpegPath(path)) {
+            thumbnails.add(fileItem, path);
         }
         fileItem->getClickEvent()->subscribe([path{std::move(path)}](brls::View* view) {
             Result res = importMiiFile(path);
@@ -194,6 +366,8 @@ int main(int argc, char* argv[]) {
         });
         fileList->addView(fileItem);
     }
+    // the first screen of thumbnails
+    thumbnails.requestAround(0);
     if(fileList->getViewsCount() == 0){
         fileList->setAllowFocus(false);
         std::stringstream ss;
@@ -252,7 +426,8 @@ int main(int argc, char* argv[]) {
                 });
                 miiItem->registerAction("Show Mii QR", brls::Key::Y, [mii{miis[i]}, name{utf8_name}] {
                     ver3StoreData qr_data;
-                    charInfoToVer3StoreData(&mii, &qr_data);
+                    // stable IDs so the same Mii always shows the same QR, and it can come from the QR cache
+                    charInfoToVer3StoreData(&mii, &qr_data, true);
                     Result res = showQrPopup(&qr_data, name);
                     if(R_FAILED(res)) {
                         errorNotify(res);
@@ -279,9 +454,14 @@ int main(int argc, char* argv[]) {
     
     brls::Application::pushView(rootFrame);
 
-    while (brls::Application::mainLoop()){};
+    while (brls::Application::mainLoop()) {
+        thumbnails.upload();
+        qr_import.poll();
+    }
 
     // Exit
+    // the import still needs the Mii and fs services
+    qr_import.wait();
     deinit();
     return EXIT_SUCCESS;
 }
\ No newline at end of file